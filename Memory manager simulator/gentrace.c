@@ -0,0 +1,536 @@
+/* Generates synthetic traces for test_malloc. Each thread draws block sizes
+ * and lifetimes from configurable distributions, can free everything it
+ * allocated during a phase in one burst at the end of it, grows some of its
+ * blocks with realloc the way a vector does, and can hand blocks to another
+ * thread to free. Lifetimes are counted in the thread's own allocations.
+ *
+ * Each thread is generated on its own from a seed derived from -S and its
+ * number, so the same options always give the same trace and a binary one
+ * can be generated twice, first to size every stream and then to write it
+ * in place, without keeping any of it in memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+#include "trace.h"
+
+#define MAX_CLASSES 64
+
+// A distribution of sizes or lifetimes, read from a spec like "power:16,4096,1.5"
+struct dist {
+	enum {D_FIXED, D_UNIFORM, D_POWER, D_BIMODAL, D_EXP} kind;
+	int n; // how many values the spec gave
+	double v[MAX_CLASSES];
+};
+
+struct event {
+	uint64_t time; // allocation count at which it happens
+	uint32_t slot;
+	uint32_t gen; // the slot's generation when it was scheduled, stale if that has moved on
+	enum {EV_FREE, EV_GROW} kind;
+};
+
+// Where one thread's generation has got to
+struct gen {
+	uint32_t thread;
+	uint64_t rng;
+	uint64_t now;
+	uint32_t phase;
+
+	// Block slots, reused last freed first so the replay needs few of them
+	uint32_t next_slot;
+	uint32_t *free_slots;
+	uint32_t num_free;
+	struct slot {
+		uint64_t birth;
+		uint64_t death;
+		uint32_t size;
+		uint32_t gen;
+		uint32_t phase;
+		uint8_t live;
+		uint8_t immortal;
+	} *slots;
+	uint32_t slots_cap;
+
+	struct event *heap; // pending frees and grows, earliest first
+	uint32_t heap_len;
+	uint32_t heap_cap;
+};
+
+// Options
+uint32_t num_threads = 4;
+uint64_t allocs = 10000; // mallocs per thread
+struct dist sizes, lifetimes;
+uint64_t phase_len = 0; // 0 for no phases
+double cross = 0; // fraction of a producer's blocks handed to its consumer
+double growth = 0; // fraction of blocks that are grown with realloc
+double immortal = 0; // fraction of blocks never freed
+double sized = 0; // fraction of frees that pass the size
+uint64_t seed = 1;
+
+// Blocks each producer put on its channel, which its consumer gets
+uint64_t *channel_puts;
+
+// Where generated ops go
+enum {OUT_TEXT, OUT_COUNT, OUT_WRITE} out_mode = OUT_TEXT;
+struct trace_tally tally;
+struct trace out_trace;
+
+void emit(struct gen *g, struct trace_op *op)
+{
+	switch (out_mode) {
+	case OUT_TEXT:
+		trace_write_op(stdout, g->thread, op);
+		break;
+	case OUT_COUNT:
+		if (trace_tally_op(&tally, g->thread, op)) {
+			exit(1);
+		}
+		break;
+	case OUT_WRITE:
+		trace_put_op(&tally, &out_trace, g->thread, op);
+		break;
+	}
+}
+
+void *xrealloc(void *p, size_t bytes)
+{
+	p = realloc(p, bytes);
+	if (!p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+/*       RANDOM NUMBERS          */
+
+uint64_t splitmix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+uint64_t next_rand(struct gen *g)
+{
+	g->rng ^= g->rng >> 12;
+	g->rng ^= g->rng << 25;
+	g->rng ^= g->rng >> 27;
+	return g->rng * 0x2545f4914f6cdd1dULL;
+}
+
+// Uniform in [0, 1)
+double uniform(struct gen *g)
+{
+	return (next_rand(g) >> 11) * 0x1.0p-53;
+}
+
+int parse_dist(const char *spec, struct dist *d)
+{
+	static const struct {
+		const char *name;
+		int kind;
+		int min, max; // values the spec takes
+	} kinds[] = {
+		{"fixed", D_FIXED, 1, MAX_CLASSES},
+		{"uniform", D_UNIFORM, 2, 2},
+		{"power", D_POWER, 3, 3},
+		{"bimodal", D_BIMODAL, 3, 3},
+		{"exp", D_EXP, 1, 1},
+	};
+	const char *p = strchr(spec, ':');
+	char *end;
+	size_t i;
+
+	if (!p) {
+		return -1;
+	}
+	for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+		if (strlen(kinds[i].name) == (size_t)(p - spec) &&
+		    strncmp(spec, kinds[i].name, p - spec) == 0) {
+			break;
+		}
+	}
+	if (i == sizeof(kinds) / sizeof(kinds[0])) {
+		return -1;
+	}
+	d->kind = kinds[i].kind;
+	d->n = 0;
+	do {
+		if (d->n == MAX_CLASSES) {
+			return -1;
+		}
+		d->v[d->n++] = strtod(p + 1, &end);
+		if (end == p + 1 || d->v[d->n - 1] < 0) {
+			return -1;
+		}
+		p = end;
+	} while (*p == ',');
+	if (*p || d->n < kinds[i].min || d->n > kinds[i].max) {
+		return -1;
+	}
+	if ((d->kind == D_UNIFORM || d->kind == D_POWER) && d->v[1] < d->v[0]) {
+		return -1;
+	}
+	if (d->kind == D_POWER && d->v[0] == 0) {
+		return -1;
+	}
+	return 0;
+}
+
+double draw(struct gen *g, struct dist *d)
+{
+	double u = uniform(g), a, lo, hi;
+	switch (d->kind) {
+	case D_FIXED:
+		return d->v[next_rand(g) % d->n];
+	case D_UNIFORM:
+		return floor(d->v[0] + u * (d->v[1] - d->v[0] + 1));
+	case D_POWER:
+		// bounded Pareto by inverting its distribution function
+		lo = d->v[0];
+		hi = d->v[1];
+		a = d->v[2];
+		if (fabs(a - 1) < 1e-9) {
+			return floor(lo * pow(hi / lo, u));
+		}
+		return floor(pow(pow(lo, 1 - a) + u * (pow(hi, 1 - a) - pow(lo, 1 - a)), 1 / (1 - a)));
+	case D_BIMODAL:
+		// within a quarter either side of the small mode with probability v[2], else of the large one
+		a = uniform(g) < d->v[2] ? d->v[0] : d->v[1];
+		return floor(a * (0.75 + 0.5 * u));
+	case D_EXP:
+		return floor(-d->v[0] * log(1 - u));
+	}
+	return 0;
+}
+
+/*      GENERATOR STATE          */
+
+void heap_push(struct gen *g, struct event ev)
+{
+	uint32_t i, parent;
+	if (g->heap_len == g->heap_cap) {
+		g->heap_cap = g->heap_cap ? g->heap_cap * 2 : 1024;
+		g->heap = xrealloc(g->heap, g->heap_cap * sizeof(*g->heap));
+	}
+	for (i = g->heap_len++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (g->heap[parent].time <= ev.time) {
+			break;
+		}
+		g->heap[i] = g->heap[parent];
+	}
+	g->heap[i] = ev;
+}
+
+struct event heap_pop(struct gen *g)
+{
+	struct event top = g->heap[0], last = g->heap[--g->heap_len];
+	uint32_t i = 0, child;
+	while ((child = 2 * i + 1) < g->heap_len) {
+		if (child + 1 < g->heap_len && g->heap[child + 1].time < g->heap[child].time) {
+			child++;
+		}
+		if (last.time <= g->heap[child].time) {
+			break;
+		}
+		g->heap[i] = g->heap[child];
+		i = child;
+	}
+	g->heap[i] = last;
+	return top;
+}
+
+uint32_t new_slot(struct gen *g)
+{
+	uint32_t s;
+	if (g->num_free) {
+		s = g->free_slots[--g->num_free];
+	} else {
+		s = g->next_slot++;
+		if (s == g->slots_cap) {
+			g->slots_cap = g->slots_cap ? g->slots_cap * 2 : 1024;
+			g->slots = xrealloc(g->slots, g->slots_cap * sizeof(*g->slots));
+			g->free_slots = xrealloc(g->free_slots, g->slots_cap * sizeof(*g->free_slots));
+			memset(&g->slots[s], 0, (g->slots_cap - s) * sizeof(*g->slots));
+		}
+	}
+	g->slots[s].live = 1;
+	g->slots[s].immortal = 0;
+	g->slots[s].phase = g->phase;
+	g->slots[s].birth = g->now;
+	return s;
+}
+
+// Forget the block in slot s, which cancels anything still scheduled for it
+void release_slot(struct gen *g, uint32_t s)
+{
+	g->slots[s].live = 0;
+	g->slots[s].gen++;
+	g->free_slots[g->num_free++] = s;
+}
+
+void free_block(struct gen *g, uint32_t s)
+{
+	struct trace_op op = {0};
+	op.type = uniform(g) < sized ? FREE_SIZED : FREE;
+	op.index = s;
+	emit(g, &op);
+	release_slot(g, s);
+}
+
+// Free the block in slot s once its lifetime is up, growing it on the way if it is one that grows
+void schedule(struct gen *g, uint32_t s, int grows)
+{
+	struct slot *b = &g->slots[s];
+	struct event ev = {0, s, b->gen, EV_FREE};
+	uint64_t life = (uint64_t)draw(g, &lifetimes) + 1;
+
+	if (uniform(g) < immortal) {
+		b->immortal = 1;
+		return;
+	}
+	b->death = g->now + life;
+	ev.time = b->death;
+	heap_push(g, ev);
+	// a vector doubles after an eighth of its life, then a quarter, then half
+	if (grows && life >= 8) {
+		ev.kind = EV_GROW;
+		ev.time = g->now + life / 8;
+		heap_push(g, ev);
+	}
+}
+
+void run_event(struct gen *g, struct event ev)
+{
+	struct slot *b = &g->slots[ev.slot];
+	struct trace_op op = {0};
+	uint64_t next;
+
+	if (!b->live || b->gen != ev.gen) {
+		return;
+	}
+	if (ev.kind == EV_FREE) {
+		free_block(g, ev.slot);
+		return;
+	}
+	b->size = b->size ? b->size * 2 : 8;
+	op.type = REALLOC;
+	op.index = ev.slot;
+	op.size = b->size;
+	emit(g, &op);
+	next = ev.time + (ev.time - b->birth);
+	if (next < b->death) {
+		ev.time = next;
+		heap_push(g, ev);
+	}
+}
+
+// At the end of a phase everything allocated during it goes, apart from the immortals
+void end_phase(struct gen *g)
+{
+	uint32_t s;
+	for (s = 0; s < g->next_slot; s++) {
+		if (g->slots[s].live && !g->slots[s].immortal && g->slots[s].phase == g->phase) {
+			free_block(g, s);
+		}
+	}
+	g->phase++;
+}
+
+/*      GENERATING A THREAD      */
+
+/* Thread t is a producer if it is even and has a neighbour, which is then
+ * its consumer. Channel t / 2 carries the blocks from one to the other, and
+ * pairing them up like this means no thread ever waits on one that is
+ * waiting for it.
+ */
+void generate_thread(uint32_t t)
+{
+	struct gen g = {0};
+	struct trace_op op;
+	uint64_t a, gets = 0, steps;
+	int producer = cross > 0 && t % 2 == 0 && t + 1 < num_threads;
+	int consumer = cross > 0 && t % 2 == 1;
+	uint32_t s;
+
+	g.thread = t;
+	g.rng = splitmix(seed * 0x100000001b3ULL + t) | 1;
+	if (producer) {
+		channel_puts[t / 2] = 0;
+	}
+	if (consumer) {
+		gets = channel_puts[t / 2];
+	}
+
+	steps = allocs + gets;
+	for (a = 0; a < steps; a++) {
+		g.now = a;
+		while (g.heap_len && g.heap[0].time <= g.now) {
+			run_event(&g, heap_pop(&g));
+		}
+		if (phase_len && a && a % phase_len == 0) {
+			end_phase(&g);
+		}
+
+		memset(&op, 0, sizeof(op));
+		s = new_slot(&g);
+		op.index = s;
+
+		// a consumer spreads its gets evenly over the steps it has left
+		if (gets && next_rand(&g) % (steps - a) < gets) {
+			gets--;
+			op.type = GET;
+			op.channel = t / 2;
+			emit(&g, &op);
+			g.slots[s].size = 0;
+			schedule(&g, s, 0);
+			continue;
+		}
+
+		op.type = MALLOC;
+		op.size = (uint32_t)draw(&g, &sizes);
+		g.slots[s].size = op.size;
+		emit(&g, &op);
+
+		if (producer && uniform(&g) < cross) {
+			op.type = PUT;
+			op.size = 0;
+			op.channel = t / 2;
+			emit(&g, &op);
+			release_slot(&g, s);
+			channel_puts[t / 2]++;
+			continue;
+		}
+		schedule(&g, s, uniform(&g) < growth);
+	}
+
+	// Let everything left run out
+	while (g.heap_len) {
+		g.now = g.heap[0].time;
+		run_event(&g, heap_pop(&g));
+	}
+
+	free(g.slots);
+	free(g.free_slots);
+	free(g.heap);
+}
+
+/*           MAIN                */
+
+void usage(char *argv[])
+{
+	printf("Usage: %s [-t threads -n mallocs -s sizes -l lifetimes -p phase -x fraction -g fraction -k fraction -z fraction -S seed -o file]\n", argv[0]);
+	printf("\t-t : number of threads, 4 by default\n");
+	printf("\t-n : blocks each thread allocates, 10000 by default\n");
+	printf("\t-s : distribution of block sizes, power:8,8192,1.6 by default\n");
+	printf("\t-l : distribution of lifetimes in allocations, exp:100 by default\n");
+	printf("\t     fixed:A,B,... picks one of the values, uniform:MIN,MAX, power:MIN,MAX,ALPHA\n");
+	printf("\t     is a power law, bimodal:SMALL,LARGE,P is within a quarter of SMALL with\n");
+	printf("\t     probability P and of LARGE otherwise, exp:MEAN is exponential\n");
+	printf("\t-p : free what is left of a phase's blocks every this many allocations\n");
+	printf("\t-x : fraction of its blocks each even thread hands to the next thread to free\n");
+	printf("\t-g : fraction of blocks grown with realloc, doubling as a vector does\n");
+	printf("\t-k : fraction of blocks never freed\n");
+	printf("\t-z : fraction of frees that pass the block's size\n");
+	printf("\t-S : random seed, 1 by default\n");
+	printf("\t-o : write a binary trace to this file instead of text to stdout\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	char *path = NULL;
+	int option, fd = -1;
+	uint32_t t;
+
+	parse_dist("power:8,8192,1.6", &sizes);
+	parse_dist("exp:100", &lifetimes);
+
+	while ((option = getopt(argc, argv, "t:n:s:l:p:x:g:k:z:S:o:h")) != -1) {
+		switch (option) {
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'n':
+			allocs = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			if (parse_dist(optarg, &sizes)) {
+				usage(argv);
+			}
+			break;
+		case 'l':
+			if (parse_dist(optarg, &lifetimes)) {
+				usage(argv);
+			}
+			break;
+		case 'p':
+			phase_len = strtoull(optarg, NULL, 10);
+			break;
+		case 'x':
+			cross = atof(optarg);
+			break;
+		case 'g':
+			growth = atof(optarg);
+			break;
+		case 'k':
+			immortal = atof(optarg);
+			break;
+		case 'z':
+			sized = atof(optarg);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			path = optarg;
+			break;
+		default:
+			usage(argv);
+		}
+	}
+	if (num_threads < 1 || num_threads > TRACE_MAX_THREADS || allocs < 1 || optind != argc) {
+		usage(argv);
+	}
+	channel_puts = xrealloc(NULL, (num_threads / 2 + 1) * sizeof(*channel_puts));
+
+	if (!path) {
+		for (t = 0; t < num_threads; t++) {
+			generate_thread(t);
+		}
+		return fflush(stdout) ? 1 : 0;
+	}
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("Binary trace open");
+		return 1;
+	}
+	out_mode = OUT_COUNT;
+	for (t = 0; t < num_threads; t++) {
+		generate_thread(t);
+	}
+	if (trace_layout(&tally, fd, &out_trace)) {
+		unlink(path);
+		return 1;
+	}
+	out_mode = OUT_WRITE;
+	for (t = 0; t < num_threads; t++) {
+		generate_thread(t);
+	}
+	trace_tally_free(&tally);
+	if (msync(out_trace.base, out_trace.length, MS_SYNC) || close(fd)) {
+		perror("Binary trace write");
+		return 1;
+	}
+	trace_close(&out_trace);
+	return 0;
+}
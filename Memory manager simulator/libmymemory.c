@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include "memory.h"
+
+/* Exports the C library's allocation functions on top of mymalloc() and myfree(), so that unmodified
+ * programs can be run on this allocator with
+ *
+ *     LD_PRELOAD=./libmymemory.so <program>
+ *
+ * and compared against the system allocator the way test_malloc_sys compares it against ours. Everything
+ * is compiled with hidden visibility and only the functions below are exported, so none of the allocator's
+ * own names can clash with the program's. There is nobody to call mymalloc_init() for us, so the first call
+ * of any of these functions does it. Programs and their compilers assume every block is aligned for
+ * max_align_t, 16 bytes on x86-64, which mymalloc() guarantees for heap blocks, slab objects and mappings.
+ */
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define PAGE 4096 // what valloc() and pvalloc() align to
+
+pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+
+/* init_allocator: sets up the allocator exactly once, on whichever thread allocates first */
+
+void init_allocator() {
+  
+  mymalloc_init(); // if even the first sbrk() fails the main arena simply starts its heap later
+}
+
+
+/* register_fork: makes fork() safe by holding every allocator lock across it. Registered from a
+ * constructor rather than from init_allocator(), since pthread_atfork() may itself call malloc()
+ */
+
+__attribute__((constructor)) void register_fork() {
+  
+  pthread_once(&init_once, init_allocator);
+  pthread_atfork(mymalloc_fork_lock, mymalloc_fork_unlock, mymalloc_fork_unlock);
+}
+
+
+EXPORT void * malloc(size_t size) {
+  
+  void * ptr;
+  
+  pthread_once(&init_once, init_allocator);
+  ptr = mymalloc(size);
+  
+  if (ptr == NULL) {
+    
+    errno = ENOMEM;
+  }
+  
+  return ptr;
+}
+
+
+EXPORT void free(void * ptr) {
+  
+  if (ptr != NULL) { // a block can only exist once the allocator is set up
+    
+    myfree(ptr);
+  }
+}
+
+
+EXPORT void * calloc(size_t n, size_t size) {
+  
+  void * ptr;
+  
+  pthread_once(&init_once, init_allocator);
+  ptr = mycalloc(n, size);
+  
+  if (ptr == NULL) {
+    
+    errno = ENOMEM;
+  }
+  
+  return ptr;
+}
+
+
+EXPORT void * realloc(void * ptr, size_t size) {
+  
+  void * newPtr;
+  
+  pthread_once(&init_once, init_allocator);
+  newPtr = myrealloc(ptr, size);
+  
+  if (newPtr == NULL && size != 0) {
+    
+    errno = ENOMEM;
+  }
+  
+  return newPtr;
+}
+
+
+EXPORT void * reallocarray(void * ptr, size_t n, size_t size) {
+  
+  if (size != 0 && n > SIZE_MAX / size) {
+    
+    errno = ENOMEM;
+    return NULL;
+  }
+  
+  return realloc(ptr, n * size);
+}
+
+
+EXPORT int posix_memalign(void ** memptr, size_t alignment, size_t size) {
+  
+  pthread_once(&init_once, init_allocator);
+  
+  return myposix_memalign(memptr, alignment, size);
+}
+
+
+EXPORT void * memalign(size_t alignment, size_t size) {
+  
+  void * ptr;
+  
+  pthread_once(&init_once, init_allocator);
+  ptr = mymemalign(alignment, size);
+  
+  if (ptr == NULL) {
+    
+    errno = alignment == 0 || (alignment & (alignment - 1)) != 0 ? EINVAL : ENOMEM;
+  }
+  
+  return ptr;
+}
+
+
+EXPORT void * aligned_alloc(size_t alignment, size_t size) {
+  
+  return memalign(alignment, size);
+}
+
+
+EXPORT void * valloc(size_t size) {
+  
+  return memalign(PAGE, size);
+}
+
+
+EXPORT void * pvalloc(size_t size) {
+  
+  if (size > SIZE_MAX - PAGE) {
+    
+    errno = ENOMEM;
+    return NULL;
+  }
+  
+  return memalign(PAGE, (size + PAGE - 1) & ~(size_t)(PAGE - 1));
+}
+
+
+EXPORT size_t malloc_usable_size(void * ptr) {
+  
+  return mymalloc_usable_size(ptr);
+}
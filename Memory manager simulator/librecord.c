@@ -0,0 +1,594 @@
+#define _GNU_SOURCE // for RTLD_NEXT
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+/* Records every allocation an unmodified program makes, for replay with test_malloc:
+ *
+ *     LD_PRELOAD=./librecord.so MALLOC_RECORD=name <program>
+ *     ./trace2bin -r name.<pid>.rec <binary trace>
+ *
+ * Calls go on to whichever allocator comes next, the C library's or one preloaded after this one.
+ * Each thread appends its calls to a buffer of its own with a couple of stores and no atomic
+ * instructions, and hands the buffer over once it is full; a writer thread wakes up every few
+ * milliseconds and writes the full buffers out, so the program never waits on the disk. Giving
+ * the blocks slots and matching up frees across threads is left to trace2bin, since it needs a
+ * table of every live block.
+ */
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define PAGE 4096
+#define BUFFER_RECORDS 16384 // 640KB of records a buffer
+#define FLUSH_NS 10000000    // how often the writer thread looks for full buffers
+#define BOOTSTRAP 65536      // served to dlsym() before the real functions are known
+
+typedef struct ___buffer_t {
+  struct ___buffer_t * next; // on the stack of full buffers waiting for the writer
+  size_t used; // records filled in, published with release so the exit flush can read a live buffer
+  struct record records[BUFFER_RECORDS];
+} buffer_t;
+
+typedef struct ___recorder_t {
+  buffer_t * buffer; // being filled by this thread, NULL until it first allocates
+  uint32_t tid;
+  int busy; // set while the recorder runs on this thread, so that what it allocates is not recorded
+  struct ___recorder_t * next; // neighbours on the list of threads with a buffer, for the exit flush
+  struct ___recorder_t * prev;
+} recorder_t;
+
+void * (*real_malloc)(size_t);
+void (*real_free)(void *);
+void * (*real_calloc)(size_t, size_t);
+void * (*real_realloc)(void *, size_t);
+void * (*real_memalign)(size_t, size_t);
+int (*real_posix_memalign)(void **, size_t, size_t);
+
+__thread recorder_t rec __attribute__((tls_model("initial-exec")));
+
+buffer_t * full; // full buffers, pushed by any thread and taken all at once by the writer
+recorder_t * recorders; // guarded by recorders_lock
+pthread_mutex_t recorders_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t exit_key;
+pthread_t writer;
+int writer_started;
+int stopping;
+int fd = -1; // the recording, -1 when there is none
+
+char bootstrap[BOOTSTRAP] __attribute__((aligned(16)));
+size_t bootstrap_used;
+int resolving;
+
+
+/* ticks: the cycle counter on x86, nanoseconds elsewhere; either only has to order the records */
+
+static inline uint64_t ticks() {
+
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+
+/* resolve: looks up the functions this library stands in front of. dlsym() can allocate itself,
+ * which is served from a static buffer meanwhile and never freed
+ */
+
+void resolve() {
+  
+  resolving = 1;
+  real_malloc = dlsym(RTLD_NEXT, "malloc");
+  real_free = dlsym(RTLD_NEXT, "free");
+  real_calloc = dlsym(RTLD_NEXT, "calloc");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  real_memalign = dlsym(RTLD_NEXT, "memalign");
+  real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+  resolving = 0;
+}
+
+
+void * bootstrap_alloc(size_t size) {
+  
+  size_t start = __atomic_fetch_add(&bootstrap_used, (size + 15) & ~(size_t)15, __ATOMIC_RELAXED);
+  
+  if (start + size > BOOTSTRAP) {
+    
+    return NULL;
+  }
+  
+  return bootstrap + start;
+}
+
+
+/* write_all: writes n bytes of a recording, returns 0 on success */
+
+int write_all(const void * data, size_t n) {
+  
+  ssize_t done;
+  
+  while (n > 0) {
+    
+    done = write(fd, data, n);
+    
+    if (done < 0 && errno == EINTR) {
+      
+      continue;
+    }
+    
+    if (done <= 0) {
+      
+      return 1;
+    }
+    
+    data = (const char *)data + done;
+    n -= done;
+  }
+  
+  return 0;
+}
+
+
+/* drain: writes out every full buffer, oldest first, and unmaps it */
+
+void drain() {
+  
+  buffer_t * list = __atomic_exchange_n(&full, NULL, __ATOMIC_ACQUIRE);
+  buffer_t * reversed = NULL;
+  buffer_t * next;
+  
+  while (list != NULL) { // the stack holds them newest first
+    
+    next = list->next;
+    list->next = reversed;
+    reversed = list;
+    list = next;
+  }
+  
+  while (reversed != NULL) {
+    
+    next = reversed->next;
+    write_all(reversed->records, reversed->used * sizeof(struct record));
+    munmap(reversed, sizeof(buffer_t));
+    reversed = next;
+  }
+}
+
+
+/* write_loop: the writer thread */
+
+void * write_loop(void * arg) {
+  
+  struct timespec pause = {0, FLUSH_NS};
+  
+  rec.busy = 1; // nothing this thread allocates is the program's
+  
+  while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    
+    nanosleep(&pause, NULL);
+    drain();
+  }
+  
+  return NULL;
+}
+
+
+/* submit: hands a buffer to the writer thread */
+
+void submit(buffer_t * buffer) {
+  
+  buffer->next = __atomic_load_n(&full, __ATOMIC_RELAXED);
+  
+  while (!__atomic_compare_exchange_n(&full, &buffer->next, buffer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  
+  }
+}
+
+
+/* thread_exit: submits what an exiting thread recorded and takes it off the list */
+
+void thread_exit(void * arg) {
+  
+  rec.busy = 1;
+  pthread_mutex_lock(&recorders_lock);
+  
+  if (rec.prev != NULL) {
+    
+    rec.prev->next = rec.next;
+  } else {
+    
+    recorders = rec.next;
+  }
+  
+  if (rec.next != NULL) {
+    
+    rec.next->prev = rec.prev;
+  }
+  
+  pthread_mutex_unlock(&recorders_lock);
+  submit(rec.buffer);
+  rec.buffer = NULL;
+  rec.busy = 0;
+}
+
+
+/* new_buffer: gives the calling thread an empty buffer, submitting the full one it had. The first
+ * time also registers the thread and starts the writer if nobody has yet. Returns NULL when the
+ * call cannot be recorded
+ */
+
+buffer_t * new_buffer() {
+  
+  buffer_t * buffer;
+  
+  if (fd < 0) {
+    
+    return NULL;
+  }
+  
+  rec.busy = 1;
+  buffer = mmap(NULL, sizeof(buffer_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  
+  if (buffer == MAP_FAILED) {
+    
+    rec.busy = 0;
+    return NULL;
+  }
+  
+  if (rec.buffer != NULL) {
+    
+    submit(rec.buffer);
+  } else {
+    
+    // the first record of this thread, or the first since it last began to exit
+    rec.tid = syscall(SYS_gettid);
+    pthread_setspecific(exit_key, &rec); // armed on every thread, the value only has to be non-NULL
+    pthread_mutex_lock(&recorders_lock);
+    rec.prev = NULL;
+    rec.next = recorders;
+    
+    if (recorders != NULL) {
+      
+      recorders->prev = &rec;
+    }
+    
+    recorders = &rec;
+    
+    if (!writer_started) {
+      
+      writer_started = pthread_create(&writer, NULL, write_loop, NULL) == 0;
+    }
+    
+    pthread_mutex_unlock(&recorders_lock);
+  }
+  
+  rec.buffer = buffer;
+  rec.busy = 0;
+  
+  return buffer;
+}
+
+
+/* record: appends one call to the calling thread's buffer */
+
+static inline void record(int type, void * ptr, uint64_t old, uint64_t size, uint64_t time) {
+  
+  buffer_t * buffer = rec.buffer;
+  struct record * r;
+  
+  if (buffer == NULL || buffer->used == BUFFER_RECORDS) {
+    
+    if ((buffer = new_buffer()) == NULL) {
+      
+      return;
+    }
+  }
+  
+  r = &buffer->records[buffer->used];
+  r->time = time;
+  r->ptr = (uint64_t)ptr;
+  r->old = old;
+  r->size = size;
+  r->thread = rec.tid;
+  r->type = type;
+  __atomic_store_n(&buffer->used, buffer->used + 1, __ATOMIC_RELEASE);
+}
+
+
+/* open_recording: starts a new recording for the current process, named after MALLOC_RECORD and
+ * the process id so that children and parallel runs do not share one
+ */
+
+void open_recording() {
+  
+  struct record_header header = {RECORD_MAGIC, RECORD_VERSION, 0};
+  const char * name = getenv("MALLOC_RECORD");
+  char path[4096];
+  
+  snprintf(path, sizeof(path), "%s.%d.rec", name != NULL ? name : "malloc", (int)getpid());
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  
+  if (fd >= 0 && write_all(&header, sizeof(header))) {
+    
+    close(fd);
+    fd = -1;
+  }
+}
+
+
+/* fork_prepare, fork_parent, fork_child: a child gets a recording of its own. The buffers it
+ * inherits hold the parent's calls, which the parent writes, and its writer thread is gone
+ */
+
+void fork_prepare() {
+  
+  pthread_mutex_lock(&recorders_lock);
+}
+
+
+void fork_parent() {
+  
+  pthread_mutex_unlock(&recorders_lock);
+}
+
+
+void fork_child() {
+  
+  pthread_mutex_init(&recorders_lock, NULL);
+  full = NULL;
+  recorders = NULL;
+  rec.buffer = NULL; // left mapped, it may be in the middle of being written from
+  writer_started = 0;
+  
+  if (fd >= 0) {
+    
+    close(fd);
+  }
+  
+  open_recording();
+}
+
+
+/* start, finish: open the recording before main() and write out everything left when the
+ * program exits, including the partly filled buffers of threads that are still running
+ */
+
+__attribute__((constructor)) void start() {
+  
+  rec.busy = 1;
+  
+  if (real_malloc == NULL) {
+    
+    resolve();
+  }
+  
+  pthread_key_create(&exit_key, thread_exit);
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+  open_recording();
+  rec.busy = 0;
+}
+
+
+__attribute__((destructor)) void finish() {
+  
+  recorder_t * r;
+  
+  rec.busy = 1;
+  
+  if (fd < 0) {
+    
+    return;
+  }
+  
+  pthread_mutex_lock(&recorders_lock);
+  
+  if (writer_started) {
+    
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+  }
+  
+  drain();
+  
+  for (r = recorders; r != NULL; r = r->next) {
+    
+    if (r->buffer != NULL) {
+      
+      write_all(r->buffer->records, __atomic_load_n(&r->buffer->used, __ATOMIC_ACQUIRE) * sizeof(struct record));
+    }
+  }
+  
+  close(fd);
+  fd = -1;
+  pthread_mutex_unlock(&recorders_lock);
+}
+
+
+EXPORT void * malloc(size_t size) {
+  
+  void * ptr;
+  
+  if (real_malloc == NULL) {
+    
+    if (resolving) {
+      
+      return bootstrap_alloc(size);
+    }
+    
+    resolve();
+  }
+  
+  ptr = real_malloc(size);
+  
+  if (!rec.busy && ptr != NULL) {
+    
+    record(REC_MALLOC, ptr, 0, size, ticks());
+  }
+  
+  return ptr;
+}
+
+
+EXPORT void free(void * ptr) {
+  
+  if (ptr == NULL || ((char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP)) {
+    
+    return;
+  }
+  
+  if (!rec.busy) { // before the block can be handed out again, see struct record
+    
+    record(REC_FREE, ptr, 0, 0, ticks());
+  }
+  
+  real_free(ptr);
+}
+
+
+EXPORT void * calloc(size_t n, size_t size) {
+  
+  void * ptr;
+  
+  if (real_calloc == NULL) {
+    
+    if (resolving) {
+      
+      return bootstrap_alloc(n * size); // zero already, it is static
+    }
+    
+    resolve();
+  }
+  
+  ptr = real_calloc(n, size);
+  
+  if (!rec.busy && ptr != NULL) {
+    
+    record(REC_CALLOC, ptr, n, size, ticks());
+  }
+  
+  return ptr;
+}
+
+
+EXPORT void * realloc(void * ptr, size_t size) {
+  
+  void * newPtr;
+  
+  if (real_realloc == NULL) {
+    
+    resolve();
+  }
+  
+  if (ptr != NULL && (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP) {
+    
+    // cannot tell how big it was, so copy what it could hold
+    size_t room = bootstrap + BOOTSTRAP - (char *)ptr;
+    newPtr = real_malloc(size);
+    
+    if (newPtr != NULL) {
+      
+      memcpy(newPtr, ptr, size < room ? size : room);
+    }
+    
+    return newPtr;
+  }
+  
+  newPtr = real_realloc(ptr, size);
+  
+  if (!rec.busy && (newPtr != NULL || size == 0)) {
+    
+    record(REC_REALLOC, newPtr, (uint64_t)ptr, size, ticks());
+  }
+  
+  return newPtr;
+}
+
+
+EXPORT void * reallocarray(void * ptr, size_t n, size_t size) {
+  
+  if (size != 0 && n > SIZE_MAX / size) {
+    
+    errno = ENOMEM;
+    return NULL;
+  }
+  
+  return realloc(ptr, n * size);
+}
+
+
+EXPORT int posix_memalign(void ** memptr, size_t alignment, size_t size) {
+  
+  int err;
+  
+  if (real_posix_memalign == NULL) {
+    
+    resolve();
+  }
+  
+  err = real_posix_memalign(memptr, alignment, size);
+  
+  if (!rec.busy && err == 0) {
+    
+    record(REC_MEMALIGN, *memptr, alignment, size, ticks());
+  }
+  
+  return err;
+}
+
+
+EXPORT void * memalign(size_t alignment, size_t size) {
+  
+  void * ptr;
+  
+  if (real_memalign == NULL) {
+    
+    resolve();
+  }
+  
+  ptr = real_memalign(alignment, size);
+  
+  if (!rec.busy && ptr != NULL) {
+    
+    record(REC_MEMALIGN, ptr, alignment, size, ticks());
+  }
+  
+  return ptr;
+}
+
+
+EXPORT void * aligned_alloc(size_t alignment, size_t size) {
+  
+  return memalign(alignment, size);
+}
+
+
+EXPORT void * valloc(size_t size) {
+  
+  return memalign(PAGE, size);
+}
+
+
+EXPORT void * pvalloc(size_t size) {
+  
+  if (size > SIZE_MAX - PAGE) {
+    
+    errno = ENOMEM;
+    return NULL;
+  }
+  
+  return memalign(PAGE, (size + PAGE - 1) & ~(size_t)(PAGE - 1));
+}
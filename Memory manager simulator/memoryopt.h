@@ -1,20 +1,173 @@
-/*       DATA STRUCTURES         */
-
-typedef struct ___node_t {
-  int size;
-  int free; //0 if free, 1 in use
-  struct ___node_t * next;
-} node_t;
-
-/*     FUNCTION PROTOTYPES       */
-
-int mymalloc_init(void);           // Returns 0 on success and >0 on error.
-void *mymalloc(unsigned int size); // Returns NULL on error.
-void * malloc_lock(unsigned int size);
-
-unsigned int myfree(void *ptr); 
-unsigned int free_lock(void *ptr);
-
-int increase_heap();
-
-int coalesce(node_t * current, int isheap);
+#include <stddef.h>
+#include <pthread.h>
+
+/*       DATA STRUCTURES         */
+
+typedef struct ___node_t {
+  size_t head; // payload size, arena index in the top byte and the CINUSE, PINUSE and CACHED bits in the bottom three
+  struct ___node_t * next; // free list links, kept in the first payload words and only meaningful while free
+  struct ___node_t * prev;
+} node_t;
+
+typedef struct ___tree_t {
+  size_t head; // same head word as node_t, large free blocks use the list links as child pointers
+  struct ___tree_t * left;
+  struct ___tree_t * right;
+} tree_t;
+
+typedef struct ___tag_t {
+  size_t size; // payload size of the free block this boundary tag ends, in use blocks have no tag
+} tag_t;
+
+#define SLAB_MAX 256                 // largest request served from a slab page
+#define SLAB_CLASSES (SLAB_MAX >> 4) // one size class per multiple of 16 bytes
+#define SLAB_WORDS 4                 // bitmap words per page, enough for 16 byte objects
+
+typedef struct ___slab_t {
+  struct ___slab_t * next; // neighbours on the arena's list of pages with free objects
+  struct ___slab_t * prev;
+  unsigned short size;     // size of every object in the page
+  unsigned short count;    // objects that fit in the page
+  unsigned short used;     // objects handed out, including those parked in thread caches
+  unsigned short arena;    // index of the arena the page belongs to
+  unsigned long map[SLAB_WORDS]; // bit i is set while object i is free
+} slab_t;
+
+#define MAX_ARENAS 64
+
+#define FIT_FIRST 0   // first block large enough, freed blocks go to the front of the list
+#define FIT_NEXT 1    // first block large enough after where the last search stopped
+#define FIT_BEST 2    // smallest block large enough
+#define FIT_ADDRESS 3 // first block large enough, the list is kept in address order
+
+#define HEAP_FREE 0   // states mymalloc_heapwalk() reports a block in
+#define HEAP_USED 1
+#define HEAP_CACHED 2 // in use as far as the heap is concerned, but parked in a thread cache, on a remote stack or on a quick list
+
+#define FAST_MAX 2048                  // largest payload kept on an arena's quick lists
+#define FAST_BINS ((FAST_MAX >> 3) + 1) // one list per payload size, which is always a multiple of 8
+
+typedef struct ___arena_t {
+  pthread_mutex_t lock; // guards everything below and every block on the list
+  node_t * freehead;
+  tree_t * tree; // free blocks too large for the list, ordered by size then address
+  slab_t * slabs[SLAB_CLASSES]; // pages with free objects, one list per size class
+  node_t * rover; // where the next FIT_NEXT search of the free list starts
+  char * heap_end; // first byte past the epilogue header of the segment this arena last grew
+  char * segments; // start of the newest segment, the first word of each points to the one before
+  char * clean; // from here to the tag of that segment's top block the memory is still zero
+  size_t grow; // bytes the next increase_heap() asks the OS for at least
+  void * remote; // blocks freed by threads of other arenas, pushed without the lock and linked through their payload
+  size_t nfree; // blocks on the list and in the tree
+  node_t * fast[FAST_BINS]; // quick lists of freed blocks not merged yet, one per exact payload size
+  size_t fast_bytes; // payload bytes on them
+  int index; // position in arenas[]
+} arena_t;
+
+#define TCACHE_MAX 1024                     // largest aligned request served by a thread cache
+#define TCACHE_BINS ((TCACHE_MAX >> 3) + 1) // one bin per 8 byte size class
+
+typedef struct ___tcache_t {
+  void * bins[TCACHE_BINS]; // singly linked through the first word of each payload
+  int counts[TCACHE_BINS];
+  int registered; // 1 once the thread exit destructor has been armed
+} tcache_t;
+
+typedef struct ___stats_t {
+  size_t requested; // bytes the program asked for, summed over every allocation
+  size_t reserved;  // bytes of heap, slab pages and mappings currently held from the OS
+  size_t mallocs;   // allocations, counting each block of a batch
+  size_t frees;
+  size_t sbrks;     // sbrk() calls that moved the break
+  size_t mmaps;     // mmap() calls for arena segments and large blocks
+  size_t free_blocks; // blocks on the arenas' free lists and trees, only filled in by mymalloc_stats()
+  size_t searches;  // find_fit() calls that walked the free list, large requests go straight to the tree
+  size_t steps;     // free list blocks those calls looked at
+  size_t max_steps; // most free list blocks a single call looked at
+  size_t coalesce[4]; // frees that merged with neither neighbour, only the left one, only the right one and both
+  size_t waits;     // lock acquisitions that had to block
+  size_t wait_ns;   // nanoseconds spent blocked in them
+} stats_t;
+
+typedef struct ___thread_stats_t {
+  stats_t counts; // only written by the owning thread
+  struct ___thread_stats_t * next; // neighbours on the list of live threads mymalloc_stats() sums up
+  struct ___thread_stats_t * prev;
+  int registered; // 1 while on that list
+} thread_stats_t;
+
+/*     FUNCTION PROTOTYPES       */
+
+int mymalloc_init(void);           // Returns 0 on success and >0 on error.
+void mymalloc_fork_lock(void);
+void mymalloc_fork_unlock(void);
+void mymalloc_stats(stats_t * out);
+void mymalloc_heapwalk(void (*visit)(void * ptr, size_t size, int state, void * arg), void * arg);
+void stats_add(stats_t * total, stats_t * counts);
+void stats_register(void);
+void stats_retire(void * ptr);
+void wait_lock(pthread_mutex_t * lock);
+void *mymalloc(size_t size);       // Returns NULL on error.
+void * malloc_lock(arena_t * arena, size_t size);
+node_t * find_fit(arena_t * arena, size_t size);
+void * split_block(arena_t * arena, node_t * currPtr, size_t size);
+void mark_used(arena_t * arena, node_t * block);
+arena_t * arena_lock();
+size_t mymalloc_batch(size_t size, size_t n, void ** out); // Returns how many of the n blocks it allocated.
+size_t carve_blocks(arena_t * arena, size_t size, size_t n, void ** out);
+void * mymemalign(size_t alignment, size_t size); // Returns NULL on error.
+int myposix_memalign(void ** memptr, size_t alignment, size_t size); // Returns 0, EINVAL or ENOMEM.
+void * memalign_lock(arena_t * arena, size_t alignment, size_t size);
+void * myrealloc(void * ptr, size_t size); // Returns NULL on error.
+int resize_block(arena_t * arena, node_t * block, size_t size);
+void * mycalloc(size_t n, size_t size); // Returns NULL on error.
+void * calloc_lock(arena_t * arena, size_t size);
+
+unsigned int myfree(void *ptr); 
+unsigned int free_lock(void *ptr);
+void free_block(arena_t * arena, node_t * freePtr);
+void fast_push(arena_t * arena, node_t * block);
+void * fast_pop(arena_t * arena, int bin);
+void fast_consolidate(arena_t * arena);
+unsigned int myfree_sized(void * ptr, size_t size); // Returns 0 on success and 1 on error.
+size_t mymalloc_usable_size(void * ptr);
+unsigned int myfree_batch(void ** ptrs, size_t n); // Returns how many of the n blocks it could not free.
+void sort_ptrs(void ** ptrs, size_t n);
+void sift_down(void ** ptrs, size_t root, size_t n);
+int trim_heap(arena_t * arena, node_t * block);
+void release_pages(char * start, char * end);
+
+void * tcache_get(size_t size);
+int tcache_put(void * ptr, int bin);
+void tcache_flush(void * cache);
+void tcache_release(void * ptr);
+arena_t * arena_of(void * ptr);
+void remote_push(arena_t * arena, void * ptr);
+void remote_drain(arena_t * arena);
+
+node_t * increase_heap(arena_t * arena, size_t size);
+char * more_core(arena_t * arena, size_t length);
+node_t * new_segment(arena_t * arena, char * base, size_t length);
+
+void * mmap_alloc(size_t size, size_t alignment);
+unsigned int mmap_free(node_t * block);
+void * mmap_resize(node_t * block, size_t size);
+
+void * slab_alloc(arena_t * arena, size_t size);
+unsigned int slab_free(void * ptr);
+slab_t * slab_page(arena_t * arena, size_t size);
+void slab_push(arena_t * arena, slab_t * slab);
+void slab_unlink(arena_t * arena, slab_t * slab);
+
+node_t * coalesce(arena_t * arena, node_t * current, int isheap);
+
+void push_free(arena_t * arena, node_t * block);
+void unlink_free(arena_t * arena, node_t * block);
+void replace_free(arena_t * arena, node_t * oldBlock, node_t * newBlock);
+void resize_free(arena_t * arena, node_t * block, size_t size);
+
+tree_t * tree_insert(tree_t * t, tree_t * x);
+tree_t * tree_remove(tree_t * t, tree_t * x);
+void tree_split(tree_t * t, tree_t * x, tree_t ** l, tree_t ** r);
+tree_t * tree_merge(tree_t * l, tree_t * r);
+tree_t * tree_fit(tree_t * t, size_t size);
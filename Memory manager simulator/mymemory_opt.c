@@ -1,401 +1,2908 @@
-#include <stdlib.h>
-#include <stdio.h>
-#include <unistd.h>
-#include <pthread.h>
-#include "memoryopt.h"
-
-
-/*********** OPTIMIZATION ******** READ-ME  *********************************/
-/*
- *     For my optimization, the 3 helper functions for Coalesce() was  
- *     combined and merged into Coalesce(). The increased speed is due 
- *     to the fact that the helper function findLeftAdj() and findPrevAdj()
- *     both iterate through the global free-list, searching for the respective
- *     nodes. By combining the two functions together and, searching for both 
- *     nodes on one iteration, The time is cut down significantly. The saves an
- *     average of m iterations where m is the number of free blocks in the list.
- * 
- *     Increase_heap() was also changed to no longer call Coalesce(), meaning it does not
- *     have to check for all cases when it is coalescing free blocks of memory together.
- *     Since it is known that when the usable heap address in increased, it is a continuous 
- *     free space of memory. This means that we only have to check the left Adjacent block
- *     to this newly freed space and add this space to that left Adjacent block. Thus we can 
- *     save time by doing fewer comparison values then if we had called Coalesce()
- * 
- *     The testing done for mymemory_opt is done by the optimization traces listed
- *     in the optimization folder. There is an 40 total traces, each with 15k instructions  
- *     running on 4 threads with an allocation average size of 300 bytes per instruction
- * 
- *     Mymemory_opt.c ran noticably faster then mymemory.c when compared together on  
- *     the test cases. 
- * 
- */
-/**************************************************************************/
-
-
-//GLOBALS
-
-node_t * freehead = NULL;
-
-pthread_mutex_t lock;
-
-//MACROS
-
-#define BLOCK_SIZE 16
-
-#define ALIGN8(x) ( (~7)&((x)+7) )
-
-
-/**************************************************************************/
-
-
-/* mymalloc_init: initialize any data structures that your malloc needs in
- *                 order to keep track of allocated and free blocks of 
- *                 memory.  Get an initial chunk of memory for the heap from
- *                 the OS using sbrk() and mark it as free so that it can  be 
- *                 used in future calls to mymalloc()
- */
-
-int mymalloc_init() {
-  
-  
- /* initalizes the global locks that the threads will use when they are 
-  * mallocing, freeing or coalescing the global linked free list 
-  */
-  pthread_mutex_init(&lock, NULL);
-  void * END_ADDRESS; // for error checking
-
-  
-  //initailizes our "heap" by one page (4096 bytes)
-  freehead = sbrk(0);
-  END_ADDRESS = sbrk(4096);   
-  
-  freehead->size = 4096 - BLOCK_SIZE;
-  freehead->next = NULL;
-  freehead->free = 0; 
-	
-  if ( END_ADDRESS == (void *) -1) {
-    return 1; // non-zero return value indicates an error
-  
-  }
-
-  return 0;
-
-}
-
-
-/*  mymalloc: Takes an unsigned int size, then calls malloc_lock which will
- *            allocate memory in our "heap" and returns back a pointer to that
- *            space for the caller  
- */
-
-void * mymalloc(unsigned int size) {
-  
-  
-  void * return_ptr;
-     
-  pthread_mutex_lock(&lock); //only one thread is allowed to malloc, since it changes our global list   
-     
-  return_ptr = malloc_lock(size); 
-    
-  pthread_mutex_unlock(&lock);
-     
-  return return_ptr;
-
-}
-
-
-/*  malloc_lock: helper function for mymalloc, takes an unsigned int and allocates a total of the size
- *               of the call plus the HEADER_SIZE. The function first searches for a large enough free 
- *               block by first fit from our free list. It will write the header information in the header
- *               space then return the free space just after the header back to the caller. The free block 
- *               that was written on will be split, and the resulting new free block will be appended back 
- *               to the front of the list 
- */
-
-void * malloc_lock(unsigned int size){
-
-  void * ret_ptr = NULL;
-  node_t * prevPtr = NULL;
-  node_t * currPtr;
-  currPtr = freehead;
-
-  /* For 1st node, indicate there is no previous. 
-   * Visit each node, maintaining a pointer to
-   * the previous node we just visited.
-   */
-
-  while (currPtr != NULL) {
-    
-    if ((currPtr->size >= ( ALIGN8(size) + BLOCK_SIZE )) && currPtr->free == 0) {
-	
-      if (prevPtr == NULL) { // This means that the free block we found is the head of the list 
-	  
-	node_t * newPtr;
-	
-	newPtr = (node_t *)((char *)currPtr + ALIGN8(size) + BLOCK_SIZE); // The free block is split into 2 pieces.
-	                                                                  // The start of the new block is pointed to 
-	                                                                  // by newPtr (Found using pointer arithmetic)
-	
-	newPtr->size = currPtr->size - ALIGN8(size) - BLOCK_SIZE; // write the necessary info for the new blocks
-	newPtr->free = 0; // 0 means the block is "free"
-	
-	newPtr->next = freehead->next; // insert new free block to beginning of list	
-	freehead = newPtr;
-
-	currPtr->size = size;
-	currPtr->free = 1; // 1 means not "free" 
-	ret_ptr = (void *)((char *)currPtr + BLOCK_SIZE);
-	  
-	return ret_ptr;	
-      }
-	
-      else { // (prevPtr != NULL) //means that the free block we found suitable is in the middle or end of the list
-	  
-	node_t * newPtr;
-	
-	newPtr = (node_t *)((char *)currPtr + ALIGN8(size) + BLOCK_SIZE);
-	newPtr->size = currPtr->size - ALIGN8(size) - BLOCK_SIZE;
-	newPtr->free = 0;
-  
-	newPtr->next = freehead;
-	freehead = newPtr;
-	prevPtr->next = currPtr->next;
-	
-	currPtr->size = size;
-	currPtr->free = 1;
-	ret_ptr = (void *)((char *)currPtr + BLOCK_SIZE);
-	  
-	return ret_ptr;	
-	
-	}
-	
-    }
-    
-    prevPtr = currPtr;
-    currPtr = currPtr->next;
-    
-  }
-  
-  if (increase_heap() == -1) {    //the code will reach here if there is not enough usuable heap space
-                                  // this increases the size of our "usuable" heap by one page (4096 bytes)  
-	  return NULL;
-	  
-  }
-	
-  ret_ptr = malloc_lock(size); //calls malloc_lock again, since we know that it can only reach here
-			     // if the heap has increased. We call malloc again with an increased heap 
-  
-  return ret_ptr;	
-  
-}   
-      
-     
-/*  increase_heap: This function increases the heapspace by a new page (4096 bytes) and adds it as a free block
- *                 into our list. It uses 16 of said bytes to create a header for the newly made free block.
- *                 The function then calls coalesce(), which will merge any blocks adjacent in memory with the
- *                 free block into one bigger block
- */
-
-int increase_heap() {
-	
-  void * END_ADDRESS;
-  
-  node_t * newPtr;
-  node_t * ptr;
-  
-  newPtr = sbrk(0);
-	
-  END_ADDRESS = sbrk(4096);	
-  if ( END_ADDRESS == (void *) -1) { // error checking
-    
-    return -1;
-  
-  }
- 
-  ptr = freehead;
-  
-  while (ptr != NULL){ // iterate through the free list, searching for both the left Adjacent and the previous
-                       // node in the free-list to the right Adjacent 
-    
-    if ((ptr->free == 0) && (newPtr == (node_t *)((char *)ptr + BLOCK_SIZE + ALIGN8(ptr->size))) ) {
-      
-      ptr->size = ALIGN8(ptr->size) + 4096;
-      return 0;
-      
-    }
-    
-    ptr = ptr->next;
-  }
-    
-  newPtr->size = 4096 - BLOCK_SIZE;
-  newPtr->next = freehead;
-  
-  freehead = newPtr;
-  
-  return 0;
-  
-}
-
-
-/*  Coalesce: Coalesce uses helper functions to find the left adjacent and right adjacent of a 
- *            free block in memory. The blocks are then merged together and added to our global 
- *            free list. We use the lowest numbered header address as the new head of our merged block;
- *            the left adjacent will always have the smallest, followed by the newly current freed block
- *            then the right adjacent. IN HEADER ADDRESSES: (left < current < right)
- */
-
-int coalesce(node_t * current, int isheap){
-
-
-  node_t * leftAdj = NULL;
-  node_t * rightAdj = NULL;
-  node_t * changeNextPtr;
-  
-  node_t * ptr;
-  
-  
-  if (isheap != 1) { // the newly allocated heap page will never have an right adj, skip if it is
-    
-    ptr = ((node_t *)((char *)current + BLOCK_SIZE + ALIGN8(current->size)));
-  
-    if (ptr->free == 0) {
-   
-      rightAdj = ptr;
-    
-    }
-  }
- 
-  ptr = freehead;
-  
-  while (ptr != NULL){ // iterate through the free list, searching for both the left Adjacent and the previous
-                       // node in the free-list to the right Adjacent 
-    
-    if ((ptr->free == 0) && (current == (node_t *)((char *)ptr + BLOCK_SIZE + ALIGN8(ptr->size))) ) {
-      leftAdj = ptr;
-      
-      if (!rightAdj) { // if there was no right Adjacent, meaning that we dont care about finding
-	              // its previous node to the right Adjacent; we can just break from the loop
-	              // to save time 
-	
-	break;
-      }
-      
-    }
-    
-    if (ptr->next == rightAdj) {
-      
-      changeNextPtr = ptr;
-      
-      if (leftAdj) { // if we have already found leftAdj, break out of the loop
-	             // this saves us time from going till the end
-	break;
-	
-      }
-      
-    }
-    
-    ptr = ptr->next;
-  }
-  
-
-  if (leftAdj && rightAdj) {  // if there are both left and right adjacent free blocks in memory
-                              // merge all 3 blocks togther, and take the left Adjacent's blocks place in
-                              // the free list. Remove the right adjacent freeblock from the freelist.
-    if (rightAdj == freehead) {
-     
-      freehead = freehead->next; // remove the right adjacent block from the freelist
-    }
-    
-    else {
-      
-      changeNextPtr->next = rightAdj->next;
-      
-    }
-    
-    leftAdj->size = ALIGN8(leftAdj->size) + ALIGN8(current->size) + ALIGN8(rightAdj->size) + (2*BLOCK_SIZE);
-    // update the new size for the left Adjacent block after it has merged together with both blocks
-    return 0;
-  }
-  
-  else if (leftAdj) {  // if there are only the left adjacent free blocks in memory
-                       // merge both blocks togther, and take the left Adjacent's blocks place in
-                       // the free list. 
-  
-    leftAdj->size = ALIGN8(leftAdj->size) + ALIGN8(current->size) + BLOCK_SIZE;
-    return 0;
-  }
-  
-  else if (rightAdj) { // if there are only the right adjacent free blocks in memory
-                       // merge both blocks togther. We will take the newly free block,
-                       // update its size after the merge with it's right adjacent and 
-                       // add it into our freelist
-    
-    if (rightAdj == freehead) {
-      
-      freehead = current;
-      current->next = rightAdj->next;
-    }
-    
-    else {
-      
-      changeNextPtr->next = current;
-      current->next = rightAdj->next;
-      
-    }
-    
-    current->size = ALIGN8(current->size) + ALIGN8(rightAdj->size) + BLOCK_SIZE;
-    return 0;
-  }
-  
-  else { // no adjacent blocks, just add the newly freed block to the front of the list.
-    
-      current->next = freehead;
-      freehead = current;
-  
-      return 0;
-  }
-  
-}
-
-
-/* myfree: calls free_lock to help unallocate memory 
- *         Only one thread can call free_lock at one time, since freeing memory will
- *         change the global linked free-list
- */
-
-unsigned int myfree(void *ptr) {
-	
-  unsigned int num;
-  
-  pthread_mutex_lock(&lock);
-	
-  num = free_lock(ptr);
-
-  pthread_mutex_unlock(&lock);
-	  
-  return num;
-}
-
-
-/* free_lock: unallocates memory that has been allocated with mymalloc.
- *            gives it a void pointer to the first byte of a block of memory allocated by 
- *            mymalloc.
- *            returns 0 if the memory was successfully freed and 1 otherwise.
- */
-
-unsigned int free_lock(void *ptr){
-  
-  node_t * freePtr;
-
-  freePtr = (node_t *)((char *)ptr - BLOCK_SIZE);
-
-  if (freePtr->free == 1) {
-	  
-    freePtr->free = 0; // changes this block to free
-    coalesce(freePtr, 0); // this new free block could be merged with other free blocks, call coalesce to check
-    return 0;
-  }
-
-  return 1;
-}
+#define _GNU_SOURCE // for mremap()
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "memoryopt.h"
+
+#ifdef SIMULATE // the build simulate links, where sbrk(), mmap() and the rest work on a simulated address space
+#include "simcore.h"
+#endif
+
+/*********** OPTIMIZATION ******** READ-ME  *********************************/
+/*
+ *     For my optimization, the 3 helper functions for Coalesce() was  
+ *     combined and merged into Coalesce(). Both neighbours of a freed block are
+ *     now found in place: the right one by pointer arithmetic over the block's
+ *     size and the left one, when the block's header says it is free, through the
+ *     boundary tag stored just before the block's header. Because the free list is doubly linked, unlinking the right
+ *     neighbour no longer needs a search for its previous node either, so freeing
+ *     costs the same no matter how many free blocks there are.
+ * 
+ *     Increase_heap() was also changed to no longer call Coalesce(), meaning it does not
+ *     have to check for all cases when it is coalescing free blocks of memory together.
+ *     Since it is known that when the usable heap address in increased, it is a continuous 
+ *     free space of memory. This means that we only have to check the left Adjacent block
+ *     to this newly freed space and add this space to that left Adjacent block. Thus we can 
+ *     save time by doing fewer comparison values then if we had called Coalesce()
+ * 
+ *     mymemory_opt is tested the same way as mymemory, with the 12 traces in traces/
+ *     replayed by test_malloc_opt. "make check" replays every one of them three times
+ *     on both allocators with their blocks checked (-t), once with the default trim
+ *     threshold and once with a 4096 byte one. Larger workloads come from gentrace, and
+ *     simulate_opt replays a trace the same way on every run to compare footprints.
+ * 
+ *     Mymemory_opt.c ran noticably faster then mymemory.c when compared together on  
+ *     the test cases. 
+ * 
+ */
+/**************************************************************************/
+
+
+//GLOBALS
+
+arena_t arenas[MAX_ARENAS]; // arena 0 grows with sbrk(), the others with mmap()
+
+int narenas = 1; // how many of arenas[] are in use, fixed by mymalloc_init()
+
+size_t mmap_threshold = 128 * 1024; // requests at least this big get a mapping of their own
+
+size_t trim_threshold = 128 * 1024; // a free top block bigger than this is given back to the OS
+
+size_t release_threshold = 256 * 1024; // free blocks at least this big have their interior pages released
+
+size_t fast_budget = 64 * 1024; // bytes an arena may hold on its quick lists before they are consolidated, 0 for none
+
+int fit_policy = FIT_FIRST; // how find_fit() picks a free block, set from MYMALLOC_POLICY
+
+int next_arena = 0; // round robin counter handing arenas to threads on their first allocation
+
+__thread arena_t * thread_arena = NULL; // the arena this thread allocates from
+
+__thread tcache_t tcache; // this thread's bins of recently freed blocks, touched without the lock
+
+pthread_key_t tcache_key; // its destructor hands a dead thread's bins back, its address is CACHE_KEY
+
+char * slab_base = NULL; // start of the address range reserved for slab pages, NULL when slabs are off
+
+char * slab_end = NULL;
+
+size_t slab_next = 0; // offset of the first slab page no arena has used yet
+
+unsigned int * slab_pool = NULL; // stack of page numbers of empty slab pages given back by the arenas
+
+size_t slab_pooled = 0;
+
+pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER; // guards slab_next and slab_pool
+
+__thread thread_stats_t stats; // this thread's counters, bumped with STAT() and never locked
+
+thread_stats_t * stats_threads = NULL; // every thread with counters, summed up by mymalloc_stats()
+
+stats_t stats_retired; // what the threads that have exited counted
+
+pthread_key_t stats_key; // only used for its destructor, which moves a dead thread's counters to stats_retired
+
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // guards stats_threads and stats_retired
+
+//MACROS
+
+#define BLOCK_SIZE 8 // just the head word, the list links of a free block live in its payload
+
+#define TAG_SIZE 8 // every free block ends in a tag_t recording its payload size
+
+#define MIN_PAYLOAD 24 // room for the list links and the tag once the block is freed
+
+#define CINUSE 1 // the block is in use
+
+#define PINUSE 2 // the block to our left in memory is in use, so it has no tag for us to read
+
+#define CACHED 4 // the block is in use but parked in a thread cache
+
+#define FLAGS (CINUSE | PINUSE | CACHED)
+
+#define ARENA_SHIFT 56 // the arena index sits in the top byte of the head word
+
+#define TREE_MIN 1024 // free blocks this big are kept in the arena's tree instead of its list
+
+#define TREE_LESS(a, b) (SIZE(a) < SIZE(b) || (SIZE(a) == SIZE(b) && (a) < (b))) // order of blocks in the tree
+
+#define PRIORITY(p) ((uintptr_t)(p) * 0x9E3779B97F4A7C15UL) // treap priority, a hash of the block's address
+
+#define ARENA_SEGMENT (256 * 1024) // first mmap() a non-main arena grows by
+
+#define HEAP_GROW_MAX (1024 * 1024) // an arena's growth doubles every time it grows, up to this
+
+#define HEAP_TOP_KEEP (64 * 1024) // free space left at the top of a heap after it is trimmed
+
+#define TCACHE_COUNT 16 // most blocks a bin holds before half of it is drained back to the free list
+
+#define TCACHE_BATCH 8 // blocks moved between a bin and the free list per lock round-trip
+
+#define ALIGNMENT 16 // every payload starts on a multiple of this, which is what max_align_t needs
+
+#define ALIGN8(x) ( (~7)&((x)+7) )
+
+#define ALIGN16(x) ( (~15)&((x)+15) )
+
+#define PAYLOAD(x) (ALIGN16((x) + BLOCK_SIZE) - BLOCK_SIZE < MIN_PAYLOAD ? MIN_PAYLOAD : \
+                    ALIGN16((x) + BLOCK_SIZE) - BLOCK_SIZE) // payload of a block holding x bytes, 8 past a multiple of 16 so the next header ends on a boundary
+
+#define HEAD_SIZE(h) ((h) & ~FLAGS & (((size_t)1 << ARENA_SHIFT) - 1)) // payload size recorded in head word h
+
+#define SIZE(p) HEAD_SIZE((p)->head) // payload size of block p
+
+#define ARENA(p) ((int)((p)->head >> ARENA_SHIFT))
+
+#define ARENA_BITS(a) ((size_t)(a)->index << ARENA_SHIFT)
+
+#define TAG(p) ((tag_t *)((char *)(p) + BLOCK_SIZE + SIZE(p) - TAG_SIZE)) // boundary tag of free block p
+
+#define ALIGN_PAGE(x) ( (~4095)&((x)+4095) )
+
+#define PAGE_DOWN(x) ( (~4095)&(x) )
+
+#define ALIGN_UP(x, a) ( (~((a)-1))&((x)+(a)-1) ) // a must be a power of two
+
+#define NEXT_BLOCK(p) ((node_t *)((char *)(p) + BLOCK_SIZE + SIZE(p))) // right neighbour in memory
+
+#define SLAB_PAGE 4096 // every slab page holds objects of one size class
+
+#define SLAB_REGION ((size_t)1 << 30) // address space reserved for slab pages, only touched pages use memory
+
+#define SLAB_HEADER ALIGN16(sizeof(slab_t)) // the objects of a page start on the first boundary after its header
+
+#define SLAB_CLASS(x) ((x) == 0 ? 0 : (ALIGN16(x) >> 4) - 1) // index into arena_t.slabs, 16 bytes is class 0
+
+#define TCACHE_BIN(x) ((x) <= SLAB_MAX && slab_base != NULL ? (SLAB_CLASS(x) + 1) << 1 : PAYLOAD(x) >> 3) // bin of the blocks a request gets, their size over 8
+
+#define SLAB_OF(p) ((slab_t *)PAGE_DOWN((uintptr_t)(p))) // header of the slab page holding object p
+
+#define IN_SLAB(p) ((char *)(p) >= slab_base && (char *)(p) < slab_end)
+
+#define CACHE_KEY ((void *)&tcache_key) // second word of a slab object parked in a thread cache, user data is unlikely to match it
+
+#define STAT(f, n) do { if (!stats.registered) stats_register(); \
+                        __atomic_store_n(&stats.counts.f, stats.counts.f + (n), __ATOMIC_RELAXED); } while (0) // only we write it, mymalloc_stats() may read it
+
+
+/**************************************************************************/
+
+
+/* mymalloc_init: initialize any data structures that your malloc needs in
+ *                 order to keep track of allocated and free blocks of 
+ *                 memory.  Get an initial chunk of memory for the heap from
+ *                 the OS using sbrk() and mark it as free so that it can  be 
+ *                 used in future calls to mymalloc()
+ */
+
+int mymalloc_init() {
+  
+  
+ /* initalizes the arena locks that the threads will use when they are 
+  * mallocing, freeing or coalescing an arena's linked free list 
+  */
+  char * env;
+  int i;
+  
+  env = getenv("MYMALLOC_ARENAS"); // defaults to one arena per online cpu
+  narenas = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  narenas = narenas < 1 ? 1 : (narenas > MAX_ARENAS ? MAX_ARENAS : narenas);
+  
+  for (i = 0; i < narenas; i++) {
+    
+    pthread_mutex_init(&arenas[i].lock, NULL);
+    arenas[i].freehead = NULL;
+    arenas[i].heap_end = NULL;
+    arenas[i].segments = NULL;
+    arenas[i].clean = NULL;
+    arenas[i].rover = NULL;
+    arenas[i].tree = NULL;
+    arenas[i].remote = NULL;
+    arenas[i].nfree = 0;
+    arenas[i].fast_bytes = 0;
+    memset(arenas[i].fast, 0, sizeof(arenas[i].fast));
+    arenas[i].grow = i == 0 ? 4096 : ARENA_SEGMENT;
+    arenas[i].index = i;
+  }
+  
+  env = getenv("MYMALLOC_MMAP_THRESHOLD");
+  
+  if (env) {
+    
+    mmap_threshold = strtoull(env, NULL, 0);
+  }
+  
+  env = getenv("MYMALLOC_TRIM_THRESHOLD");
+  
+  if (env) {
+    
+    trim_threshold = strtoull(env, NULL, 0);
+  }
+  
+  env = getenv("MYMALLOC_RELEASE_THRESHOLD");
+  
+  if (env) {
+    
+    release_threshold = strtoull(env, NULL, 0);
+  }
+  
+  env = getenv("MYMALLOC_FAST_BUDGET");
+  
+  if (env) {
+    
+    fast_budget = strtoull(env, NULL, 0);
+  }
+  
+  env = getenv("MYMALLOC_POLICY"); // first, next, best or address
+  
+  if (env) {
+    
+    fit_policy = strcmp(env, "next") == 0 ? FIT_NEXT :
+                 strcmp(env, "best") == 0 ? FIT_BEST :
+                 strcmp(env, "address") == 0 ? FIT_ADDRESS : FIT_FIRST;
+  }
+  
+  env = getenv("MYMALLOC_SLAB"); // MYMALLOC_SLAB=0 serves small requests from the heap like any other
+  
+  if (env == NULL || atoi(env) != 0) {
+    
+    slab_base = mmap(NULL, SLAB_REGION, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    slab_pool = mmap(NULL, (SLAB_REGION / SLAB_PAGE) * sizeof(unsigned int), PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    
+    if (slab_base == MAP_FAILED || slab_pool == MAP_FAILED) { // not fatal, small requests just go to the heap
+      
+      if (slab_base != MAP_FAILED) {
+	
+	munmap(slab_base, SLAB_REGION);
+      }
+      
+      if (slab_pool != MAP_FAILED) {
+	
+	munmap(slab_pool, (SLAB_REGION / SLAB_PAGE) * sizeof(unsigned int));
+      }
+      
+      slab_base = NULL;
+      slab_pool = NULL;
+    }
+    
+    else {
+      
+      slab_end = slab_base + SLAB_REGION;
+    }
+  }
+  
+  pthread_key_create(&tcache_key, tcache_flush); // flushes a thread's cache when it exits
+  pthread_key_create(&stats_key, stats_retire); // keeps a thread's counters once it exits
+  void * START_ADDRESS; // for error checking
+
+  
+  //initailizes the main arena's "heap" by one page (4096 bytes), the other arenas map their memory on first use
+  START_ADDRESS = sbrk(4096);   
+	
+  if ( START_ADDRESS == (void *) -1) {
+    return 1; // non-zero return value indicates an error
+  
+  }
+  
+  STAT(sbrks, 1);
+  STAT(reserved, 4096);
+  
+  push_free(&arenas[0], new_segment(&arenas[0], START_ADDRESS, 4096)); // the whole page minus its fences is one free block
+
+  return 0;
+
+}
+
+
+/*  mymalloc_fork_lock: takes every arena's lock, then slab_lock and stats_lock, in the order the allocator itself
+ *                      takes them, so that fork() cannot copy the heap into the child while another thread is
+ *                      halfway through changing it. Meant as the prepare handler of pthread_atfork().
+ */
+
+void mymalloc_fork_lock() {
+  
+  int i;
+  
+  for (i = 0; i < narenas; i++) {
+    
+    pthread_mutex_lock(&arenas[i].lock);
+  }
+  
+  pthread_mutex_lock(&slab_lock);
+  pthread_mutex_lock(&stats_lock);
+}
+
+
+/*  mymalloc_fork_unlock: releases what mymalloc_fork_lock() took. Runs in both the parent and the child,
+ *                        where the thread that called fork() is the one holding the locks.
+ */
+
+void mymalloc_fork_unlock() {
+  
+  int i;
+  
+  pthread_mutex_unlock(&stats_lock);
+  pthread_mutex_unlock(&slab_lock);
+  
+  for (i = narenas - 1; i >= 0; i--) {
+    
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+}
+
+
+/*  mymalloc_stats: fills out with what the allocator has counted since mymalloc_init(). Every thread keeps
+ *                  its own counters, so counting never makes two threads touch the same cache line; this
+ *                  sums the counters of the live threads and of those that have exited. The free block count
+ *                  is read from the arenas. A thread may be bumping its counters while they are summed, so the
+ *                  totals are a snapshot, not an exact cut.
+ */
+
+void mymalloc_stats(stats_t * out) {
+  
+  thread_stats_t * ts;
+  int i;
+  
+  memset(out, 0, sizeof(stats_t));
+  
+  pthread_mutex_lock(&stats_lock);
+  
+  stats_add(out, &stats_retired);
+  
+  for (ts = stats_threads; ts != NULL; ts = ts->next) {
+    
+    stats_add(out, &ts->counts);
+  }
+  
+  pthread_mutex_unlock(&stats_lock);
+  
+  for (i = 0; i < narenas; i++) {
+    
+    out->free_blocks += __atomic_load_n(&arenas[i].nfree, __ATOMIC_RELAXED);
+  }
+}
+
+
+/*  stats_add HELPER: adds one thread's counters to total. The maximum search depth is the largest of the two
+ *                    instead. reserved goes down in whichever thread gives memory back, so it only makes sense
+ *                    summed over all the threads.
+ */
+
+void stats_add(stats_t * total, stats_t * counts) {
+  
+  size_t max_steps = __atomic_load_n(&counts->max_steps, __ATOMIC_RELAXED);
+  int i;
+  
+  total->requested += __atomic_load_n(&counts->requested, __ATOMIC_RELAXED);
+  total->reserved += __atomic_load_n(&counts->reserved, __ATOMIC_RELAXED);
+  total->mallocs += __atomic_load_n(&counts->mallocs, __ATOMIC_RELAXED);
+  total->frees += __atomic_load_n(&counts->frees, __ATOMIC_RELAXED);
+  total->sbrks += __atomic_load_n(&counts->sbrks, __ATOMIC_RELAXED);
+  total->mmaps += __atomic_load_n(&counts->mmaps, __ATOMIC_RELAXED);
+  total->searches += __atomic_load_n(&counts->searches, __ATOMIC_RELAXED);
+  total->steps += __atomic_load_n(&counts->steps, __ATOMIC_RELAXED);
+  total->max_steps = max_steps > total->max_steps ? max_steps : total->max_steps;
+  
+  for (i = 0; i < 4; i++) {
+    
+    total->coalesce[i] += __atomic_load_n(&counts->coalesce[i], __ATOMIC_RELAXED);
+  }
+  
+  total->waits += __atomic_load_n(&counts->waits, __ATOMIC_RELAXED);
+  total->wait_ns += __atomic_load_n(&counts->wait_ns, __ATOMIC_RELAXED);
+}
+
+
+/*  stats_register HELPER: puts this thread's counters on stats_threads the first time it counts something,
+ *                         and arms stats_key so that they are kept when the thread exits
+ */
+
+void stats_register() {
+  
+  pthread_mutex_lock(&stats_lock);
+  
+  stats.prev = NULL;
+  stats.next = stats_threads;
+  
+  if (stats_threads != NULL) {
+    
+    stats_threads->prev = &stats;
+  }
+  
+  stats_threads = &stats;
+  stats.registered = 1;
+  
+  pthread_mutex_unlock(&stats_lock);
+  
+  pthread_setspecific(stats_key, &stats);
+}
+
+
+/*  stats_retire: destructor for stats_key. Adds an exiting thread's counters to stats_retired and takes them
+ *                off stats_threads before the thread's storage goes away. The counters are cleared in case a
+ *                later destructor, like tcache_flush(), counts something and registers them again.
+ */
+
+void stats_retire(void * ptr) {
+  
+  thread_stats_t * ts = (thread_stats_t *)ptr;
+  
+  pthread_mutex_lock(&stats_lock);
+  
+  if (ts->prev != NULL) {
+    
+    ts->prev->next = ts->next;
+  }
+  
+  else {
+    
+    stats_threads = ts->next;
+  }
+  
+  if (ts->next != NULL) {
+    
+    ts->next->prev = ts->prev;
+  }
+  
+  stats_add(&stats_retired, &ts->counts);
+  memset(&ts->counts, 0, sizeof(stats_t));
+  ts->registered = 0;
+  
+  pthread_mutex_unlock(&stats_lock);
+}
+
+
+/*  wait_lock: takes lock like pthread_mutex_lock(). Only when someone else holds it is the clock read, and the
+ *             wait and how long it took are counted, so an uncontended lock costs no more than before.
+ */
+
+void wait_lock(pthread_mutex_t * lock) {
+  
+  struct timespec start;
+  struct timespec end;
+  
+  if (pthread_mutex_trylock(lock) == 0) {
+    
+    return;
+  }
+  
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(lock);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  
+  STAT(waits, 1);
+  STAT(wait_ns, (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec));
+}
+
+
+/*  mymalloc_heapwalk: calls visit once for every block of every arena's heap, segment by segment and in
+ *                     address order within a segment, with the block's payload address, its payload size, its
+ *                     state (HEAP_FREE, HEAP_USED or HEAP_CACHED) and arg. Each arena is walked with its lock
+ *                     held, so visit must not call into the allocator. Slab pages and blocks with a mapping of
+ *                     their own are not part of any heap and are not visited.
+ */
+
+void mymalloc_heapwalk(void (*visit)(void * ptr, size_t size, int state, void * arg), void * arg) {
+  
+  arena_t * arena;
+  char * segment;
+  node_t * block;
+  size_t head;
+  int i;
+  
+  for (i = 0; i < narenas; i++) {
+    
+    arena = &arenas[i];
+    wait_lock(&arena->lock);
+    
+    for (segment = arena->segments; segment != NULL; segment = *(char **)segment) {
+      
+      block = (node_t *)(segment + sizeof(char *));
+      head = __atomic_load_n(&block->head, __ATOMIC_RELAXED); // another thread may be caching a block of ours
+      
+      while (HEAD_SIZE(head) != 0) { // only the epilogue is empty
+	
+	visit((char *)block + BLOCK_SIZE, HEAD_SIZE(head),
+	      !(head & CINUSE) ? HEAP_FREE : (head & CACHED) ? HEAP_CACHED : HEAP_USED, arg);
+	
+	block = (node_t *)((char *)block + BLOCK_SIZE + HEAD_SIZE(head));
+	head = __atomic_load_n(&block->head, __ATOMIC_RELAXED);
+      }
+    }
+    
+    pthread_mutex_unlock(&arena->lock);
+  }
+}
+
+
+/*  mymalloc: Takes a size_t size, then calls malloc_lock which will
+ *            allocate memory in this thread's arena and returns back a pointer to that
+ *            space for the caller. Requests of mmap_threshold bytes or more skip the
+ *            arenas and get a mapping of their own from mmap_alloc()
+ */
+
+void * mymalloc(size_t size) {
+  
+  
+  void * return_ptr;
+  arena_t * arena;
+  
+  STAT(mallocs, 1);
+  STAT(requested, size);
+  
+  if (size >= mmap_threshold) {
+    
+    return mmap_alloc(size, BLOCK_SIZE);
+  }
+  
+  if (size <= TCACHE_MAX && TCACHE_BIN(size) << 3 <= TCACHE_MAX) { // small requests are served by this thread's cache first
+    
+    return_ptr = tcache_get(size);
+    
+    if (return_ptr) {
+      
+      return return_ptr;
+    }
+  }
+     
+  arena = arena_lock(); //only one thread is allowed to malloc from an arena at a time, since it changes its list   
+     
+  return_ptr = malloc_lock(arena, size); 
+    
+  pthread_mutex_unlock(&arena->lock);
+     
+  return return_ptr;
+
+}
+
+
+/*  arena_lock: returns the calling thread's arena with its lock held. Threads are handed arenas round
+ *              robin on their first allocation. If the thread's arena is busy the other arenas are tried
+ *              without blocking, and the thread moves to the first free one so that contending threads
+ *              spread out over the arenas. Only when every arena is busy do we wait for our own.
+ */
+
+arena_t * arena_lock() {
+  
+  arena_t * arena;
+  arena_t * other;
+  int i;
+  
+  arena = thread_arena;
+  
+  if (arena == NULL) {
+    
+    arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % narenas];
+    thread_arena = arena;
+  }
+  
+  if (pthread_mutex_trylock(&arena->lock) == 0) {
+    
+    return arena;
+  }
+  
+  for (i = 1; i < narenas; i++) {
+    
+    other = &arenas[(arena->index + i) % narenas];
+    
+    if (pthread_mutex_trylock(&other->lock) == 0) {
+      
+      thread_arena = other;
+      return other;
+    }
+  }
+  
+  wait_lock(&arena->lock);
+  
+  return arena;
+}
+
+
+/*  malloc_lock: helper function for mymalloc, takes a size_t and allocates a total of the size
+ *               of the call plus the BLOCK_SIZE header. The function first
+ *               searches for a large enough free block in the arena's free list with find_fit() and hands
+ *               it to split_block(). If no block is large enough the heap is grown once by increase_heap(),
+ *               and the block it returns is split straight away instead of searching the list again.
+ *               Requests of up to SLAB_MAX bytes are handed to slab_alloc() first, and only come to the
+ *               free list once the slab range is used up. A block of exactly the right size on the arena's
+ *               quick lists is taken as it is, without searching or splitting. Blocks other threads left on
+ *               the arena's remote stack are freed first.
+ */
+
+void * malloc_lock(arena_t * arena, size_t size){
+
+  node_t * currPtr;
+  void * objPtr;
+  
+  if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) != NULL) { // other threads freed some of our blocks
+    
+    remote_drain(arena);
+  }
+  
+  if (size <= SLAB_MAX && slab_base != NULL) { // small requests are packed into slab pages without headers
+    
+    objPtr = slab_alloc(arena, size);
+    
+    if (objPtr != NULL) {
+      
+      return objPtr;
+    }
+  }
+  
+  if (PAYLOAD(size) <= FAST_MAX && arena->fast[PAYLOAD(size) >> 3] != NULL) { // freed lately and never merged, reuse it whole
+    
+    return fast_pop(arena, PAYLOAD(size) >> 3);
+  }
+  
+  currPtr = find_fit(arena, size);
+  
+  if (currPtr != NULL) {
+    
+    return split_block(arena, currPtr, size);
+  }
+  
+  currPtr = increase_heap(arena, size); //the code will reach here if there is not enough usuable heap space
+  
+  if (currPtr == NULL) {
+    
+    return NULL;
+  }
+	
+  return split_block(arena, currPtr, size); // the grown block is always large enough for the request
+  
+}   
+
+
+/*  find_fit: searches the arena's free blocks for one with room for size bytes. Blocks smaller than
+ *            TREE_MIN are on the free list, which is searched under fit_policy: FIT_FIRST and FIT_ADDRESS
+ *            take the first block that is large enough, FIT_NEXT does the same but starts at the arena's
+ *            rover, where the last search stopped, and wraps around once. FIT_BEST walks the whole list for
+ *            the smallest block that fits, unless it finds one too small to split. Larger requests, and
+ *            small ones the list cannot serve, take the best fit from the arena's tree in O(log n). If
+ *            nothing fits, the arena's quick lists are consolidated with fast_consolidate() and the search
+ *            runs once more, so blocks parked there never make the heap grow.
+ *            Returns NULL if no block is large enough.
+ */
+
+node_t * find_fit(arena_t * arena, size_t size) {
+  
+  node_t * currPtr;
+  node_t * startPtr;
+  node_t * bestPtr = NULL;
+  size_t steps = 0;
+  
+  /* Every block on the list is free, and since the list is doubly linked
+   * the block we pick can be unlinked without remembering its previous node.
+   */
+  
+  if (PAYLOAD(size) >= TREE_MIN) { // nothing on the list is that big
+    
+    bestPtr = (node_t *)tree_fit(arena->tree, PAYLOAD(size));
+    
+    if (bestPtr == NULL && arena->fast_bytes != 0) {
+      
+      fast_consolidate(arena);
+      bestPtr = (node_t *)tree_fit(arena->tree, PAYLOAD(size));
+    }
+    
+    return bestPtr;
+  }
+  
+  if (fit_policy == FIT_BEST) {
+    
+    for (currPtr = arena->freehead; currPtr != NULL; currPtr = currPtr->next) {
+      
+      steps++;
+      
+      if (SIZE(currPtr) >= PAYLOAD(size) && (bestPtr == NULL || SIZE(currPtr) < SIZE(bestPtr))) {
+	
+	bestPtr = currPtr;
+	
+	if (SIZE(bestPtr) - PAYLOAD(size) < BLOCK_SIZE + MIN_PAYLOAD) { // it will be handed out whole, nothing fits better
+	  
+	  break;
+	}
+      }
+    }
+  }
+  
+  else if (fit_policy == FIT_NEXT) {
+    
+    startPtr = arena->rover != NULL ? arena->rover : arena->freehead;
+    currPtr = startPtr;
+    
+    while (currPtr != NULL) {
+      
+      steps++;
+      
+      if (SIZE(currPtr) >= PAYLOAD(size)) {
+	
+	arena->rover = currPtr; // split_block() moves it on to the remainder or the next block
+	bestPtr = currPtr;
+	break;
+      }
+      
+      currPtr = currPtr->next != NULL ? currPtr->next : arena->freehead;
+      
+      if (currPtr == startPtr) {
+	
+	break;
+      }
+    }
+  }
+  
+  else {
+    
+    for (currPtr = arena->freehead; currPtr != NULL; currPtr = currPtr->next) {
+      
+      steps++;
+      
+      if (SIZE(currPtr) >= PAYLOAD(size)) {
+	
+	bestPtr = currPtr;
+	break;
+      }
+    }
+  }
+  
+  STAT(searches, 1);
+  STAT(steps, steps);
+  
+  if (steps > stats.counts.max_steps) {
+    
+    STAT(max_steps, steps - stats.counts.max_steps);
+  }
+  
+  if (bestPtr == NULL) { // the smallest large block will do
+    
+    bestPtr = (node_t *)tree_fit(arena->tree, PAYLOAD(size));
+  }
+  
+  if (bestPtr == NULL && arena->fast_bytes != 0) { // the space may be parked on the quick lists
+    
+    fast_consolidate(arena);
+    return find_fit(arena, size);
+  }
+  
+  return bestPtr;
+}
+
+
+/*  split_block: takes a free block on the arena's list that is large enough for size and allocates its
+ *               front part. It will write the header information in the header space then return the
+ *               free space just after the header back to the caller. The rest of the free block becomes a
+ *               new free block, unless it is too small to hold a block of its own, in which case the whole
+ *               block is handed out. Under FIT_FIRST, or if the block was in the tree, the rest goes back
+ *               through push_free(); on the list the other policies have it take the old block's place so
+ *               that the list stays in address order and the rover stays where it was.
+ */
+
+void * split_block(arena_t * arena, node_t * currPtr, size_t size) {
+  
+  node_t * newPtr;
+  size_t rest;
+  
+  rest = SIZE(currPtr) - PAYLOAD(size);
+  
+  if (rest < BLOCK_SIZE + MIN_PAYLOAD) { // not worth splitting, the block's right neighbour learns it is in use
+    
+    unlink_free(arena, currPtr);
+    currPtr->head |= CINUSE;
+    __atomic_fetch_or(&NEXT_BLOCK(currPtr)->head, PINUSE, __ATOMIC_RELAXED); // it may be cached by another thread right now
+    mark_used(arena, currPtr);
+    
+    return (void *)((char *)currPtr + BLOCK_SIZE);
+  }
+  
+  newPtr = (node_t *)((char *)currPtr + BLOCK_SIZE + PAYLOAD(size)); // The free block is split into 2 pieces.
+	                                                             // The start of the new block is pointed to
+	                                                             // by newPtr (Found using pointer arithmetic)
+  
+  newPtr->head = (rest - BLOCK_SIZE) | PINUSE | ARENA_BITS(arena); // 0 in the CINUSE bit means the block is "free"
+  TAG(newPtr)->size = SIZE(newPtr); // the remainder keeps the old block's tag slot at its end
+  
+  if (fit_policy == FIT_FIRST || SIZE(currPtr) >= TREE_MIN) {
+    
+    unlink_free(arena, currPtr);
+    push_free(arena, newPtr); // insert new free block to beginning of list, or into the tree
+  }
+  
+  else {
+    
+    replace_free(arena, currPtr, newPtr);
+  }
+  
+  currPtr->head = PAYLOAD(size) | (currPtr->head & PINUSE) | CINUSE | ARENA_BITS(arena); // the arena bits let myfree() find its way back here
+  mark_used(arena, currPtr);
+  
+  return (void *)((char *)currPtr + BLOCK_SIZE);
+}
+
+/*  mark_used HELPER: moves the arena's clean mark past a block that has just been handed out, and past the
+ *                    header and list links of the free block that may follow it, when the block lies in the
+ *                    segment the arena grows
+ */
+
+void mark_used(arena_t * arena, node_t * block) {
+  
+  char * end = (char *)NEXT_BLOCK(block) + sizeof(node_t);
+  
+  if (end > arena->clean && (char *)block < arena->heap_end) {
+    
+    arena->clean = end;
+  }
+}
+
+
+/*  mymalloc_batch: allocates n blocks of size bytes each and stores them in out[0] to out[n-1], taking the
+ *                  arena's lock once for all of them. Slab sized requests come from the arena's slab pages,
+ *                  the rest are carved back to back out of a single free region by carve_blocks(). Requests
+ *                  of mmap_threshold bytes or more get a mapping each. Returns the number of blocks allocated;
+ *                  if that is less than n the remaining slots of out are set to NULL.
+ */
+
+size_t mymalloc_batch(size_t size, size_t n, void ** out) {
+  
+  size_t done = 0;
+  size_t i;
+  void * ptr;
+  arena_t * arena;
+  
+  STAT(mallocs, n);
+  STAT(requested, n * size);
+  
+  if (size >= mmap_threshold) {
+    
+    while (done < n && (out[done] = mmap_alloc(size, BLOCK_SIZE)) != NULL) {
+      
+      done++;
+    }
+  }
+  
+  else if (n > 0) {
+    
+    arena = arena_lock();
+    
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) != NULL) {
+      
+      remote_drain(arena);
+    }
+    
+    if (size <= SLAB_MAX && slab_base != NULL) {
+      
+      while (done < n && (ptr = slab_alloc(arena, size)) != NULL) {
+	
+	out[done++] = ptr;
+      }
+    }
+    
+    if (done < n) {
+      
+      done += carve_blocks(arena, size, n - done, out + done);
+    }
+    
+    pthread_mutex_unlock(&arena->lock);
+  }
+  
+  for (i = done; i < n; i++) {
+    
+    out[i] = NULL;
+  }
+  
+  return done;
+}
+
+
+/*  carve_blocks: helper function for mymalloc_batch, finds one free region with room for n blocks of size
+ *                bytes, with find_fit() or else increase_heap(), and cuts the blocks from it one after the
+ *                other. The region leaves the free list once and whatever is left after the last block goes
+ *                back on it once, or is handed out with the last block if it is too small to stand alone.
+ *                If no region is large enough the blocks are allocated one at a time with malloc_lock().
+ *                The caller holds the arena's lock. Returns the number of blocks carved.
+ */
+
+size_t carve_blocks(arena_t * arena, size_t size, size_t n, void ** out) {
+  
+  node_t * currPtr = NULL;
+  node_t * newPtr;
+  size_t step = BLOCK_SIZE + PAYLOAD(size); // distance from one block's header to the next
+  size_t rest;
+  size_t pinuse;
+  size_t i;
+  
+  if (size <= (SIZE_MAX >> 2) && n <= (SIZE_MAX >> 2) / step) { // the region size below cannot wrap around
+    
+    currPtr = find_fit(arena, n * step - BLOCK_SIZE);
+    
+    if (currPtr == NULL) {
+      
+      currPtr = increase_heap(arena, n * step - BLOCK_SIZE);
+    }
+  }
+  
+  if (currPtr == NULL) { // no single region, settle for separate blocks
+    
+    for (i = 0; i < n && (out[i] = malloc_lock(arena, size)) != NULL; i++);
+    
+    return i;
+  }
+  
+  unlink_free(arena, currPtr);
+  
+  rest = SIZE(currPtr) - (n * step - BLOCK_SIZE);
+  pinuse = currPtr->head & PINUSE;
+  
+  for (i = 0; i < n; i++) {
+    
+    if (i > 0) {
+      
+      currPtr = NEXT_BLOCK(currPtr);
+    }
+    
+    currPtr->head = PAYLOAD(size) | pinuse | CINUSE | ARENA_BITS(arena);
+    pinuse = PINUSE; // every block after the first follows one we just handed out
+    out[i] = (char *)currPtr + BLOCK_SIZE;
+  }
+  
+  if (rest >= BLOCK_SIZE + MIN_PAYLOAD) { // what is left becomes a free block of its own
+    
+    newPtr = NEXT_BLOCK(currPtr);
+    newPtr->head = (rest - BLOCK_SIZE) | PINUSE | ARENA_BITS(arena);
+    TAG(newPtr)->size = SIZE(newPtr);
+    push_free(arena, newPtr);
+  }
+  
+  else {
+    
+    currPtr->head += rest;
+    __atomic_fetch_or(&NEXT_BLOCK(currPtr)->head, PINUSE, __ATOMIC_RELAXED);
+  }
+  
+  mark_used(arena, currPtr); // the blocks are back to back, the last one reaches furthest
+  
+  return n;
+}
+
+
+/*  mymemalign: allocates size bytes whose address is a multiple of alignment, which must be a power of two.
+ *              Alignments of up to ALIGNMENT bytes are what every block gets anyway and go to mymalloc(). The rest
+ *              are carved out of the arena's heap by memalign_lock(), or get a mapping of their own from
+ *              mmap_alloc() once the padded request reaches mmap_threshold. The block is an ordinary one
+ *              and is freed with myfree().
+ *              Returns NULL on error.
+ */
+
+void * mymemalign(size_t alignment, size_t size) {
+  
+  void * return_ptr;
+  arena_t * arena;
+  
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    
+    return NULL;
+  }
+  
+  if (alignment <= ALIGNMENT) {
+    
+    return mymalloc(size);
+  }
+  
+  if (size > (SIZE_MAX >> 2) || alignment > (SIZE_MAX >> 2)) { // no heap or mapping can be that big
+    
+    return NULL;
+  }
+  
+  STAT(mallocs, 1);
+  STAT(requested, size);
+  
+  if (size + alignment >= mmap_threshold) {
+    
+    return mmap_alloc(size, alignment);
+  }
+  
+  arena = arena_lock();
+  
+  return_ptr = memalign_lock(arena, alignment, size);
+  
+  pthread_mutex_unlock(&arena->lock);
+  
+  return return_ptr;
+}
+
+
+/*  myposix_memalign: the POSIX flavour of mymemalign(), which stores the block in *memptr. The alignment
+ *                    must also be a multiple of sizeof(void *).
+ *                    Returns 0 on success, EINVAL for a bad alignment and ENOMEM if there is no memory.
+ */
+
+int myposix_memalign(void ** memptr, size_t alignment, size_t size) {
+  
+  void * ptr;
+  
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void *) != 0) {
+    
+    return EINVAL;
+  }
+  
+  ptr = mymemalign(alignment, size);
+  
+  if (ptr == NULL) {
+    
+    return ENOMEM;
+  }
+  
+  *memptr = ptr;
+  
+  return 0;
+}
+
+
+/*  memalign_lock: helper function for mymemalign, finds a free block with room for size bytes plus enough
+ *                 slack to move the payload up to the next multiple of alignment. The bytes in front of the
+ *                 aligned block become a free block of their own, so the payload is moved up by a further
+ *                 alignment when the gap is too small to hold one. Whatever is left after the payload is
+ *                 split off as in split_block(). The caller holds the arena's lock.
+ */
+
+void * memalign_lock(arena_t * arena, size_t alignment, size_t size) {
+  
+  node_t * currPtr;
+  node_t * newPtr;
+  uintptr_t payload;
+  size_t lead;
+  size_t rest;
+  
+  if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) != NULL) {
+    
+    remote_drain(arena);
+  }
+  
+  currPtr = find_fit(arena, PAYLOAD(size) + alignment + BLOCK_SIZE + MIN_PAYLOAD);
+  
+  if (currPtr == NULL) {
+    
+    currPtr = increase_heap(arena, PAYLOAD(size) + alignment + BLOCK_SIZE + MIN_PAYLOAD);
+  }
+  
+  if (currPtr == NULL) {
+    
+    return NULL;
+  }
+  
+  unlink_free(arena, currPtr);
+  
+  payload = ALIGN_UP((uintptr_t)currPtr + BLOCK_SIZE, alignment);
+  lead = payload - ((uintptr_t)currPtr + BLOCK_SIZE);
+  
+  while (lead > 0 && lead < BLOCK_SIZE + MIN_PAYLOAD) { // too small for a free block, skip to the next boundary
+    
+    payload += alignment;
+    lead += alignment;
+  }
+  
+  if (lead > 0) { // the padding in front becomes a free block for somebody else
+    
+    newPtr = (node_t *)(payload - BLOCK_SIZE);
+    newPtr->head = (SIZE(currPtr) - lead) | ARENA_BITS(arena);
+    currPtr->head = (lead - BLOCK_SIZE) | (currPtr->head & PINUSE) | ARENA_BITS(arena);
+    TAG(currPtr)->size = SIZE(currPtr);
+    push_free(arena, currPtr);
+    currPtr = newPtr;
+  }
+  
+  rest = SIZE(currPtr) - PAYLOAD(size);
+  
+  if (rest >= BLOCK_SIZE + MIN_PAYLOAD) {
+    
+    newPtr = (node_t *)((char *)currPtr + BLOCK_SIZE + PAYLOAD(size));
+    newPtr->head = (rest - BLOCK_SIZE) | PINUSE | ARENA_BITS(arena);
+    TAG(newPtr)->size = SIZE(newPtr);
+    push_free(arena, newPtr);
+    currPtr->head = PAYLOAD(size) | (currPtr->head & PINUSE) | ARENA_BITS(arena);
+  }
+  
+  else {
+    
+    __atomic_fetch_or(&NEXT_BLOCK(currPtr)->head, PINUSE, __ATOMIC_RELAXED);
+  }
+  
+  currPtr->head |= CINUSE;
+  mark_used(arena, currPtr);
+  
+  return (void *)((char *)currPtr + BLOCK_SIZE);
+}
+
+
+/*  myrealloc: changes the size of the block at ptr to size bytes and returns where it now lives. Heap blocks
+ *             are resized in place by resize_block() whenever their right neighbour or the top of the heap
+ *             leaves room, and mapped blocks are moved by the kernel with mremap() instead of being copied.
+ *             Slab objects keep their place as long as the new size fits their class. Only when none of
+ *             that works is a new block allocated, the contents copied over and the old block freed.
+ *             A NULL ptr is a plain mymalloc() and a size of 0 frees ptr.
+ *             Returns NULL on error, in which case ptr is left untouched.
+ */
+
+void * myrealloc(void * ptr, size_t size) {
+  
+  node_t * block;
+  arena_t * arena;
+  void * newPtr;
+  size_t head;
+  size_t old;
+  int resized;
+  
+  if (ptr == NULL) {
+    
+    return mymalloc(size);
+  }
+  
+  if (size == 0) {
+    
+    myfree(ptr);
+    return NULL;
+  }
+  
+  if (size > (SIZE_MAX >> 2)) { // no heap can grow that much
+    
+    return NULL;
+  }
+  
+  if (IN_SLAB(ptr)) {
+    
+    old = SLAB_OF(ptr)->size;
+    
+    if (size <= old) {
+      
+      STAT(requested, size);
+      return ptr;
+    }
+  }
+  
+  else {
+    
+    block = (node_t *)((char *)ptr - BLOCK_SIZE);
+    head = __atomic_load_n(&block->head, __ATOMIC_RELAXED);
+    
+    if (!(head & (CINUSE | PINUSE))) { // mapped on its own
+      
+      newPtr = mmap_resize(block, size);
+      
+      if (newPtr != NULL) {
+	
+	STAT(requested, size);
+	return newPtr;
+      }
+    }
+    
+    else if ((head & (CINUSE | CACHED)) != CINUSE) { // not a block the caller owns
+      
+      return NULL;
+    }
+    
+    else {
+      
+      arena = &arenas[head >> ARENA_SHIFT];
+      
+      wait_lock(&arena->lock);
+      resized = resize_block(arena, block, size);
+      pthread_mutex_unlock(&arena->lock);
+      
+      if (resized) {
+	
+	STAT(requested, size);
+	return ptr;
+      }
+    }
+    
+    old = HEAD_SIZE(head);
+  }
+  
+  newPtr = mymalloc(size); // last resort, move the contents to a new block
+  
+  if (newPtr == NULL) {
+    
+    return NULL;
+  }
+  
+  memcpy(newPtr, ptr, old < size ? old : size);
+  myfree(ptr);
+  
+  return newPtr;
+}
+
+
+/*  resize_block: helper function for myrealloc, changes the payload of an in-use heap block to hold size
+ *                bytes without moving it. A block that has to grow takes in its right neighbour if that one
+ *                is free and large enough; if the block sits at the top of the heap the heap is grown first
+ *                with increase_heap(), which leaves the new space free right after it. Any excess of at least
+ *                a minimum block, including what is left after shrinking, is split off the end and freed with
+ *                free_lock(). A tail of up to FAST_MAX bytes is parked unmerged on the arena's quick lists,
+ *                if they have room, until fast_consolidate() runs; otherwise it merges with a free block
+ *                further right. The caller holds the lock.
+ *                Returns 1 if the block was resized and 0 if it has to move.
+ */
+
+int resize_block(arena_t * arena, node_t * block, size_t size) {
+  
+  node_t * rightPtr;
+  node_t * tailPtr;
+  size_t rightHead;
+  size_t avail;
+  
+  rightPtr = NEXT_BLOCK(block);
+  rightHead = __atomic_load_n(&rightPtr->head, __ATOMIC_RELAXED); // it may be cached by another thread right now
+  
+  if (PAYLOAD(size) > SIZE(block)) {
+    
+    avail = SIZE(block) + (rightHead & CINUSE ? 0 : BLOCK_SIZE + HEAD_SIZE(rightHead));
+    
+    if (avail < PAYLOAD(size) &&
+	(char *)(rightHead & CINUSE ? rightPtr : NEXT_BLOCK(rightPtr)) + BLOCK_SIZE == arena->heap_end) { // top of the heap
+      
+      if (increase_heap(arena, PAYLOAD(size) - avail) == NULL) {
+	
+	return 0;
+      }
+      
+      rightHead = __atomic_load_n(&rightPtr->head, __ATOMIC_RELAXED); // free now, unless the heap went elsewhere
+      avail = SIZE(block) + (rightHead & CINUSE ? 0 : BLOCK_SIZE + HEAD_SIZE(rightHead));
+    }
+    
+    if (avail < PAYLOAD(size)) {
+      
+      return 0;
+    }
+    
+    unlink_free(arena, rightPtr);
+    block->head += BLOCK_SIZE + SIZE(rightPtr);
+    __atomic_fetch_or(&NEXT_BLOCK(block)->head, PINUSE, __ATOMIC_RELAXED);
+    mark_used(arena, block);
+  }
+  
+  if (SIZE(block) - PAYLOAD(size) >= BLOCK_SIZE + MIN_PAYLOAD) { // give the excess back
+    
+    tailPtr = (node_t *)((char *)block + BLOCK_SIZE + PAYLOAD(size));
+    tailPtr->head = (SIZE(block) - PAYLOAD(size) - BLOCK_SIZE) | PINUSE | CINUSE | ARENA_BITS(arena);
+    block->head -= SIZE(block) - PAYLOAD(size);
+    free_lock((char *)tailPtr + BLOCK_SIZE);
+  }
+  
+  return 1;
+}
+
+
+/*  mycalloc: allocates zeroed memory for an array of n elements of size bytes each. Small blocks come
+ *            from this thread's cache, which only holds recycled blocks, and are simply cleared. Larger ones
+ *            go through calloc_lock(), which clears only what the heap has handed out before, and a mapping
+ *            of our own is zero already.
+ *            Returns NULL on error, including when n * size does not fit in a size_t.
+ */
+
+void * mycalloc(size_t n, size_t size) {
+  
+  void * return_ptr;
+  arena_t * arena;
+  size_t total;
+  
+  if (size != 0 && n > SIZE_MAX / size) { // n * size would wrap around
+    
+    return NULL;
+  }
+  
+  total = n * size;
+  
+  STAT(mallocs, 1);
+  STAT(requested, total);
+  
+  if (total >= mmap_threshold) {
+    
+    return mmap_alloc(total, BLOCK_SIZE); // fresh pages from the kernel are zero
+  }
+  
+  if (total <= TCACHE_MAX && TCACHE_BIN(total) << 3 <= TCACHE_MAX) {
+    
+    return_ptr = tcache_get(total);
+    
+    if (return_ptr) {
+      
+      memset(return_ptr, 0, total);
+      return return_ptr;
+    }
+  }
+  
+  arena = arena_lock();
+  
+  return_ptr = calloc_lock(arena, total);
+  
+  pthread_mutex_unlock(&arena->lock);
+  
+  return return_ptr;
+}
+
+
+/*  calloc_lock: helper function for mycalloc, allocates size bytes like malloc_lock() and zeroes them.
+ *               Everything in the segment the arena grows from arena->clean up to the tag of its top block
+ *               is still zero as the OS handed it over, so only the part of the block below that mark and the
+ *               tag slot, if the block took the whole top block, have to be cleared. A block anywhere else is
+ *               cleared in full. The caller holds the arena's lock.
+ */
+
+void * calloc_lock(arena_t * arena, size_t size) {
+  
+  node_t * currPtr;
+  char * ptr;
+  char * clean;
+  char * top;
+  
+  if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) != NULL) {
+    
+    remote_drain(arena);
+  }
+  
+  if (size <= SLAB_MAX && slab_base != NULL) {
+    
+    ptr = slab_alloc(arena, size);
+    
+    if (ptr != NULL) {
+      
+      memset(ptr, 0, size);
+      return ptr;
+    }
+  }
+  
+  currPtr = find_fit(arena, size);
+  
+  if (currPtr == NULL) {
+    
+    currPtr = increase_heap(arena, size);
+  }
+  
+  if (currPtr == NULL) {
+    
+    return NULL;
+  }
+  
+  clean = arena->clean; // split_block() moves the mark past our block
+  top = arena->heap_end - BLOCK_SIZE - TAG_SIZE;
+  ptr = split_block(arena, currPtr, size);
+  
+  if (ptr >= arena->heap_end || ptr + size <= clean) { // recycled, or from an older segment
+    
+    memset(ptr, 0, size);
+    return ptr;
+  }
+  
+  if (ptr < clean) {
+    
+    memset(ptr, 0, clean - ptr);
+  }
+  
+  if (ptr + size > top) {
+    
+    memset(top, 0, ptr + size - top);
+  }
+  
+  return ptr;
+}
+      
+     
+/*  increase_heap: This function grows the arena's heap with a single call to more_core() and adds the new space
+ *                 as a free block into its list. The arena grows by arena->grow bytes, or by enough pages for the
+ *                 request if that is more, and arena->grow doubles each time up to HEAP_GROW_MAX, so a program that
+ *                 keeps allocating needs fewer and fewer system calls. When the new space directly follows the heap
+ *                 the old epilogue header becomes part of it. If the block to the left of it is free we simply grow
+ *                 that block in place, otherwise the space becomes a free block of its own. If something else took
+ *                 the addresses in between, the space is set up as a new fenced segment instead. Space the OS
+ *                 hands us is zero, so the clean range of a free top block simply grows with it.
+ *                 Returns the free block holding the new space, or NULL if the OS has no more memory for us.
+ */
+
+node_t * increase_heap(arena_t * arena, size_t size) {
+	
+  char * START_ADDRESS;
+  size_t length;
+  size_t needed;
+  
+  node_t * newPtr;
+  node_t * epilogue;
+  tag_t * leftTag;
+  node_t * leftPtr;
+  
+  if (size > (SIZE_MAX >> 2)) { // no heap can grow that much
+    
+    return NULL;
+  }
+  
+  needed = ALIGN_PAGE(PAYLOAD(size) + 2*BLOCK_SIZE + 16); // room for the request even as a fenced segment
+  length = needed < arena->grow ? arena->grow : needed;
+  
+  START_ADDRESS = more_core(arena, length);
+  
+  if (START_ADDRESS == NULL && length > needed) { // the geometric step was too greedy, settle for what we need
+    
+    length = needed;
+    START_ADDRESS = more_core(arena, length);
+  }
+  
+  if (START_ADDRESS == NULL) { // error checking
+    
+    return NULL;
+  }
+  
+  if (arena->grow < HEAP_GROW_MAX) {
+    
+    arena->grow = arena->grow * 2;
+  }
+  
+  if (START_ADDRESS != arena->heap_end) { // not contiguous with our heap, start a new segment
+    
+    newPtr = new_segment(arena, START_ADDRESS, length);
+    push_free(arena, newPtr);
+    return newPtr;
+  }
+  
+  newPtr = (node_t *)(arena->heap_end - BLOCK_SIZE); // the old epilogue header
+  
+  if (!(newPtr->head & PINUSE)) { // grow the free block at the top of the heap, it is already on the list
+    
+    leftTag = (tag_t *)((char *)newPtr - TAG_SIZE); // tag of the last block before the epilogue
+    leftPtr = (node_t *)((char *)newPtr - leftTag->size - BLOCK_SIZE);
+    resize_free(arena, leftPtr, SIZE(leftPtr) + length);
+    newPtr = leftPtr;
+  }
+  
+  else { // reuse the old epilogue header for a new free block
+    
+    newPtr->head = (length - BLOCK_SIZE) | PINUSE | ARENA_BITS(arena);
+    TAG(newPtr)->size = SIZE(newPtr);
+    push_free(arena, newPtr);
+  }
+  
+  epilogue = NEXT_BLOCK(newPtr); // the new end of the heap
+  epilogue->head = CINUSE | ARENA_BITS(arena);
+  arena->heap_end += length;
+  
+  if (arena->clean <= START_ADDRESS - BLOCK_SIZE - TAG_SIZE) { // the old tag and epilogue are now inside the clean range
+    
+    memset(START_ADDRESS - BLOCK_SIZE - TAG_SIZE, 0, BLOCK_SIZE + TAG_SIZE);
+  }
+
+  return newPtr;
+  
+}
+
+
+/*  more_core: gets length more bytes of address space for the arena in a single system call. The main arena
+ *             moves the break with sbrk(), the other arenas ask mmap() for the address right after their heap so
+ *             that they can usually keep growing in place. Returns the start of the new space or NULL on error.
+ */
+
+char * more_core(arena_t * arena, size_t length) {
+  
+  char * START_ADDRESS;
+  
+  if (arena->index == 0) {
+    
+    START_ADDRESS = sbrk(length);
+    
+    if (START_ADDRESS == (void *) -1) {
+      
+      return NULL;
+    }
+    
+    STAT(sbrks, 1);
+    STAT(reserved, length);
+    
+    return START_ADDRESS;
+  }
+  
+  START_ADDRESS = mmap(arena->heap_end, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  
+  if (START_ADDRESS == MAP_FAILED) {
+    
+    return NULL;
+  }
+  
+  STAT(mmaps, 1);
+  STAT(reserved, length);
+  
+  return START_ADDRESS;
+}
+
+
+/*  new_segment: lays out length bytes starting at base, which are not contiguous with the rest of our heap.
+ *               The region starts with a word linking it to the arena's previous segment, so that
+ *               mymalloc_heapwalk() can find every segment. The first block is marked as having an in-use
+ *               left neighbour and the region ends in an in-use epilogue header, so that find_leftAdj() and
+ *               find_rightAdj() never walk off its ends.
+ *               Returns the free block spanning the rest of the region; the caller puts it on the free list.
+ */
+
+node_t * new_segment(arena_t * arena, char * base, size_t length) {
+  
+  node_t * newPtr;
+  node_t * epilogue;
+  char * segment;
+  
+  segment = (char *)ALIGN16((unsigned long)base); // sbrk(0) is not guaranteed to be aligned, our payloads must be
+  *(char **)segment = arena->segments;
+  arena->segments = segment;
+  
+  newPtr = (node_t *)(segment + sizeof(char *));
+  length -= (char *)newPtr - base;
+  
+  newPtr->head = (((~15) & (length - 3*BLOCK_SIZE)) + BLOCK_SIZE) | PINUSE | ARENA_BITS(arena); // what is left after our own header and the epilogue, kept 8 past a multiple of 16
+  TAG(newPtr)->size = SIZE(newPtr);
+  
+  epilogue = NEXT_BLOCK(newPtr);
+  epilogue->head = CINUSE | ARENA_BITS(arena);
+  
+  arena->heap_end = (char *)epilogue + BLOCK_SIZE;
+  arena->clean = (char *)newPtr + sizeof(node_t); // all of it is zero apart from the headers, the tag and the links push_free() writes
+  
+  return newPtr;
+}
+
+
+/*  Coalesce: Coalesce finds the left adjacent and right adjacent of a free block in memory.
+ *            The blocks are then merged together and added to our global free list. We use the
+ *            lowest numbered header address as the new head of our merged block; the left adjacent
+ *            will always have the smallest, followed by the newly current freed block then the right
+ *            adjacent. IN HEADER ADDRESSES: (left < current < right). Returns the merged free block.
+ */
+
+node_t * coalesce(arena_t * arena, node_t * current, int isheap){
+
+
+  node_t * leftAdj = NULL;
+  node_t * rightAdj = NULL;
+  
+  tag_t * leftTag;
+  node_t * ptr;
+  
+  
+  if (isheap != 1) { // the newly allocated heap page will never have an right adj, skip if it is
+    
+    ptr = NEXT_BLOCK(current);
+  
+    if (!(__atomic_load_n(&ptr->head, __ATOMIC_RELAXED) & CINUSE)) { // an in-use neighbour may be getting cached right now
+   
+      rightAdj = ptr;
+    
+    }
+  }
+  
+  if (!(current->head & PINUSE)) { // only a free block leaves a boundary tag for us, it gives its size
+    
+    leftTag = (tag_t *)((char *)current - TAG_SIZE);
+    leftAdj = (node_t *)((char *)current - leftTag->size - BLOCK_SIZE);
+  }
+  
+
+  if (leftAdj && rightAdj) {  // if there are both left and right adjacent free blocks in memory
+                              // merge all 3 blocks togther, and take the left Adjacent's blocks place in
+                              // the free list. Remove the right adjacent freeblock from the freelist.
+    STAT(coalesce[3], 1);
+    unlink_free(arena, rightAdj);
+    
+    resize_free(arena, leftAdj, SIZE(leftAdj) + SIZE(current) + SIZE(rightAdj) + 2*BLOCK_SIZE);
+    // update the new size for the left Adjacent block after it has merged together with both blocks
+    return leftAdj;
+  }
+  
+  else if (leftAdj) {  // if there are only the left adjacent free blocks in memory
+                       // merge both blocks togther, and take the left Adjacent's blocks place in
+                       // the free list. 
+  
+    if (!isheap) { // growing the heap is not a free
+      
+      STAT(coalesce[1], 1);
+    }
+    resize_free(arena, leftAdj, SIZE(leftAdj) + SIZE(current) + BLOCK_SIZE);
+    return leftAdj;
+  }
+  
+  else if (rightAdj) { // if there are only the right adjacent free blocks in memory
+                       // merge both blocks togther. We will take the newly free block,
+                       // update its size after the merge with it's right adjacent and 
+                       // add it into our freelist
+    
+    STAT(coalesce[2], 1);
+    unlink_free(arena, rightAdj);
+    
+    current->head += SIZE(rightAdj) + BLOCK_SIZE;
+    TAG(current)->size = SIZE(current);
+    push_free(arena, current);
+    return current;
+  }
+  
+  else { // no adjacent blocks, just add the newly freed block to the front of the list.
+    
+      if (!isheap) {
+        
+        STAT(coalesce[0], 1);
+      }
+      push_free(arena, current);
+  
+      return current;
+  }
+  
+}
+
+
+/*  push_free HELPER: inserts a free block at the front of the arena's free list, or under FIT_ADDRESS
+ *                    in front of the first free block above it in memory. Blocks of TREE_MIN bytes or
+ *                    more go into the arena's tree instead.
+ */
+
+void push_free(arena_t * arena, node_t * block) {
+  
+  node_t * prevPtr = NULL;
+  node_t * nextPtr = arena->freehead;
+  
+  __atomic_store_n(&arena->nfree, arena->nfree + 1, __ATOMIC_RELAXED); // mymalloc_stats() reads it without the lock
+  
+  if (SIZE(block) >= TREE_MIN) {
+    
+    arena->tree = tree_insert(arena->tree, (tree_t *)block);
+    return;
+  }
+  
+  if (fit_policy == FIT_ADDRESS) {
+    
+    while (nextPtr != NULL && nextPtr < block) {
+      
+      prevPtr = nextPtr;
+      nextPtr = nextPtr->next;
+    }
+  }
+  
+  block->prev = prevPtr;
+  block->next = nextPtr;
+  
+  if (nextPtr != NULL) {
+    
+    nextPtr->prev = block;
+  }
+  
+  if (prevPtr != NULL) {
+    
+    prevPtr->next = block;
+  }
+  
+  else {
+    
+    arena->freehead = block;
+  }
+}
+
+
+/*  unlink_free HELPER: removes a block from anywhere in the arena's free list in constant time, or from
+ *                      its tree in O(log n)
+ */
+
+void unlink_free(arena_t * arena, node_t * block) {
+  
+  __atomic_store_n(&arena->nfree, arena->nfree - 1, __ATOMIC_RELAXED);
+  
+  if (SIZE(block) >= TREE_MIN) {
+    
+    arena->tree = tree_remove(arena->tree, (tree_t *)block);
+    return;
+  }
+  
+  if (block->prev != NULL) {
+    
+    block->prev->next = block->next;
+  }
+  
+  else {
+    
+    arena->freehead = block->next;
+  }
+  
+  if (block->next != NULL) {
+    
+    block->next->prev = block->prev;
+  }
+  
+  if (arena->rover == block) { // the next search starts after the block instead
+    
+    arena->rover = block->next;
+  }
+}
+
+
+/*  replace_free HELPER: puts newBlock in oldBlock's place on the arena's free list
+ */
+
+void replace_free(arena_t * arena, node_t * oldBlock, node_t * newBlock) {
+  
+  newBlock->prev = oldBlock->prev;
+  newBlock->next = oldBlock->next;
+  
+  if (newBlock->prev != NULL) {
+    
+    newBlock->prev->next = newBlock;
+  }
+  
+  else {
+    
+    arena->freehead = newBlock;
+  }
+  
+  if (newBlock->next != NULL) {
+    
+    newBlock->next->prev = newBlock;
+  }
+  
+  if (arena->rover == oldBlock) {
+    
+    arena->rover = newBlock;
+  }
+}
+  
+
+
+/*  resize_free HELPER: sets the payload size of a free block that is on the arena's list or tree. Blocks
+ *                      that stay on the list keep their place in it, a block in the tree is taken out and
+ *                      put back since its key changes.
+ */
+
+void resize_free(arena_t * arena, node_t * block, size_t size) {
+  
+  if (SIZE(block) < TREE_MIN && size < TREE_MIN) {
+    
+    block->head = block->head - SIZE(block) + size;
+    TAG(block)->size = size;
+    return;
+  }
+  
+  unlink_free(arena, block);
+  block->head = block->head - SIZE(block) + size;
+  TAG(block)->size = size;
+  push_free(arena, block);
+}
+
+
+/*  tree_insert: inserts free block x into the treap rooted at t and returns the new root. Blocks are
+ *               ordered by size, then by address, and a block's priority is a hash of its address, so
+ *               the tree has the shape of a random binary search tree without any field beyond the two
+ *               child pointers, which take the place of the list links.
+ */
+
+tree_t * tree_insert(tree_t * t, tree_t * x) {
+  
+  if (t == NULL || PRIORITY(x) > PRIORITY(t)) { // x goes here, everything below splits around it
+    
+    tree_split(t, x, &x->left, &x->right);
+    return x;
+  }
+  
+  if (TREE_LESS(x, t)) {
+    
+    t->left = tree_insert(t->left, x);
+  }
+  
+  else {
+    
+    t->right = tree_insert(t->right, x);
+  }
+  
+  return t;
+}
+
+
+/*  tree_remove: takes block x, which must be in it, out of the treap rooted at t and returns the new root
+ */
+
+tree_t * tree_remove(tree_t * t, tree_t * x) {
+  
+  if (t == NULL || t == x) {
+    
+    return t == NULL ? NULL : tree_merge(t->left, t->right);
+  }
+  
+  if (TREE_LESS(x, t)) {
+    
+    t->left = tree_remove(t->left, x);
+  }
+  
+  else {
+    
+    t->right = tree_remove(t->right, x);
+  }
+  
+  return t;
+}
+
+
+/*  tree_split HELPER: splits the treap rooted at t into the blocks ordered before x, left in *l, and the
+ *                     ones after it, left in *r
+ */
+
+void tree_split(tree_t * t, tree_t * x, tree_t ** l, tree_t ** r) {
+  
+  if (t == NULL) {
+    
+    *l = NULL;
+    *r = NULL;
+  }
+  
+  else if (TREE_LESS(t, x)) {
+    
+    *l = t;
+    tree_split(t->right, x, &t->right, r);
+  }
+  
+  else {
+    
+    *r = t;
+    tree_split(t->left, x, l, &t->left);
+  }
+}
+
+
+/*  tree_merge HELPER: joins two treaps where every block in l is ordered before every block in r and
+ *                     returns the root of the result
+ */
+
+tree_t * tree_merge(tree_t * l, tree_t * r) {
+  
+  if (l == NULL || r == NULL) {
+    
+    return l == NULL ? r : l;
+  }
+  
+  if (PRIORITY(l) > PRIORITY(r)) {
+    
+    l->right = tree_merge(l->right, r);
+    return l;
+  }
+  
+  r->left = tree_merge(l, r->left);
+  return r;
+}
+
+
+/*  tree_fit: returns the smallest block in the treap rooted at t with a payload of at least size bytes,
+ *            the lowest addressed one if there are several, or NULL if every block is smaller
+ */
+
+tree_t * tree_fit(tree_t * t, size_t size) {
+  
+  tree_t * bestPtr = NULL;
+  
+  while (t != NULL) {
+    
+    if (SIZE(t) >= size) {
+      
+      bestPtr = t;
+      t = t->left;
+    }
+    
+    else {
+      
+      t = t->right;
+    }
+  }
+  
+  return bestPtr;
+}
+  
+
+/* myfree: calls free_lock to help unallocate memory 
+ *         Only one thread can call free_lock on an arena at one time, since freeing memory will
+ *         change its linked free-list. The block goes back to the arena that handed it out,
+ *         whichever thread frees it, but a thread freeing another arena's block does not wait for
+ *         that arena's lock; it leaves the block on the arena's remote stack with remote_push().
+ *         The flags of an in-use block can be changed by whoever holds its arena's lock at the same
+ *         time, so they are set with atomic operations here.
+ */
+
+unsigned int myfree(void *ptr) {
+	
+  unsigned int num;
+  node_t * freePtr;
+  arena_t * arena;
+  size_t head;
+  
+  STAT(frees, 1);
+  
+  if (IN_SLAB(ptr)) { // slab objects have no header, their page knows their size class
+    
+    return tcache_put(ptr, SLAB_OF(ptr)->size >> 3);
+  }
+  
+  freePtr = (node_t *)((char *)ptr - BLOCK_SIZE);
+  head = __atomic_load_n(&freePtr->head, __ATOMIC_RELAXED);
+  
+  if (!(head & (CINUSE | PINUSE))) { // mapped on its own, give it straight back to the OS
+    
+    return mmap_free(freePtr);
+  }
+  
+  if ((head & (CINUSE | CACHED)) == CINUSE && HEAD_SIZE(head) <= TCACHE_MAX) { // park small blocks in this thread's cache
+    
+    __atomic_fetch_or(&freePtr->head, CACHED, __ATOMIC_RELAXED); // parked in the cache, coalesce() leaves it alone
+    return tcache_put(ptr, HEAD_SIZE(head) >> 3);
+  }
+  
+  arena = &arenas[head >> ARENA_SHIFT];
+  
+  if (arena != thread_arena && (head & (CINUSE | CACHED)) == CINUSE) { // its owner frees it on its next allocation
+    
+    __atomic_fetch_or(&freePtr->head, CACHED, __ATOMIC_RELAXED);
+    remote_push(arena, ptr);
+    return 0;
+  }
+  
+  wait_lock(&arena->lock);
+	
+  num = free_lock(ptr);
+
+  pthread_mutex_unlock(&arena->lock);
+	  
+  return num;
+}
+
+
+/* myfree_sized: frees a block whose size the caller still knows, which must be the size it was allocated
+ *               or last reallocated with. A slab object goes to the bin of its page's size class, since
+ *               myrealloc() shrinks slab objects in place and size may belong to a smaller class; a size
+ *               larger than the class cannot be right and the object is left alone. A heap block does
+ *               not use size at all: its head word holds the size and the flags myfree() changes, so it
+ *               goes through myfree().
+ *               Returns 0 if the memory was successfully freed and 1 otherwise.
+ */
+
+unsigned int myfree_sized(void * ptr, size_t size) {
+  
+  if (IN_SLAB(ptr)) {
+    
+    if (size > SLAB_OF(ptr)->size) {
+      
+      return 1;
+    }
+    
+    STAT(frees, 1);
+    return tcache_put(ptr, SLAB_OF(ptr)->size >> 3); // the bin of a slab object is its size over 8
+  }
+  
+  return myfree(ptr);
+}
+
+
+/* mymalloc_usable_size: returns how many bytes the block at ptr can hold, which can be more than was asked
+ *                       for because of rounding or a remainder too small to split off. The caller may use
+ *                       all of them, and myrealloc() keeps all of them. Returns 0 for NULL.
+ */
+
+size_t mymalloc_usable_size(void * ptr) {
+  
+  if (ptr == NULL) {
+    
+    return 0;
+  }
+  
+  if (IN_SLAB(ptr)) {
+    
+    return SLAB_OF(ptr)->size;
+  }
+  
+  return SIZE((node_t *)((char *)ptr - BLOCK_SIZE)); // the same for heap blocks and mappings
+}
+
+
+/* free_lock: unallocates memory that has been allocated with mymalloc.
+ *            gives it a void pointer to the first byte of a block of memory allocated by 
+ *            mymalloc. The caller holds the lock of the arena returned by arena_of(ptr).
+ *            Slab objects are handed to slab_free(). Blocks of up to FAST_MAX bytes are parked on the
+ *            arena's quick lists by fast_push() while the lists hold less than fast_budget bytes; once
+ *            they would hold more, fast_consolidate() empties them and the block is freed as usual by
+ *            free_block().
+ *            returns 0 if the memory was successfully freed and 1 otherwise.
+ */
+
+unsigned int free_lock(void *ptr){
+  
+  node_t * freePtr;
+  arena_t * arena;
+  
+  if (IN_SLAB(ptr)) {
+    
+    return slab_free(ptr);
+  }
+
+  freePtr = (node_t *)((char *)ptr - BLOCK_SIZE);
+
+  if ((freePtr->head & (CINUSE | CACHED)) != CINUSE) {
+    
+    return 1;
+  }
+  
+  arena = &arenas[ARENA(freePtr)];
+  
+  if (SIZE(freePtr) <= FAST_MAX && fast_budget != 0) {
+    
+    if (arena->fast_bytes + SIZE(freePtr) <= fast_budget) {
+      
+      fast_push(arena, freePtr);
+      return 0;
+    }
+    
+    fast_consolidate(arena);
+  }
+  
+  free_block(arena, freePtr);
+  
+  return 0;
+}
+
+
+/* free_block: marks an in-use block of the arena free and merges it with its free neighbours. If the
+ *             merged free block ends up at the top of the heap it may be trimmed off with trim_heap(), and
+ *             if it is large its pages go back to the OS with release_pages(). The caller holds the lock.
+ */
+
+void free_block(arena_t * arena, node_t * freePtr) {
+  
+  node_t * mergedPtr;
+  node_t * rightPtr;
+  int leftReleased;
+  int rightReleased;
+  size_t rightHead;
+  
+  freePtr->head &= ~CINUSE; // changes this block to free
+  TAG(freePtr)->size = SIZE(freePtr); // free blocks end in a tag so their right neighbour can find them
+  rightPtr = NEXT_BLOCK(freePtr);
+  rightHead = __atomic_and_fetch(&rightPtr->head, ~(size_t)PINUSE, __ATOMIC_RELAXED); // it may be cached by another thread right now
+  
+  // free neighbours this big already had their pages released when they were freed
+  leftReleased = !(freePtr->head & PINUSE) && ((tag_t *)((char *)freePtr - TAG_SIZE))->size >= release_threshold;
+  rightReleased = !(rightHead & CINUSE) && HEAD_SIZE(rightHead) >= release_threshold;
+  
+  mergedPtr = coalesce(arena, freePtr, 0); // this new free block could be merged with other free blocks, call coalesce to check
+  
+  if (trim_heap(arena, mergedPtr) == 0 && SIZE(mergedPtr) >= release_threshold) { // keep the head word and the list links
+    
+    release_pages(mergedPtr != freePtr && leftReleased ? (char *)freePtr : (char *)mergedPtr + sizeof(node_t),
+		  rightReleased ? (char *)rightPtr : (char *)TAG(mergedPtr));
+  }
+}
+
+
+/* fast_push: parks a block the program freed on the arena's quick list of its exact size instead of
+ *            merging it with its neighbours. It stays in use as far as they are concerned, marked as cached
+ *            like a block in a thread cache, so a program that frees and allocates the same sizes over and
+ *            over skips the merging and splitting in between. The caller holds the lock.
+ */
+
+void fast_push(arena_t * arena, node_t * block) {
+  
+  block->head |= CACHED;
+  block->next = arena->fast[SIZE(block) >> 3];
+  arena->fast[SIZE(block) >> 3] = block;
+  arena->fast_bytes += SIZE(block);
+}
+
+
+/* fast_pop: takes the most recently parked block off quick list bin, which must not be empty, and hands
+ *           it out again as it is. Returns the block's payload. The caller holds the lock.
+ */
+
+void * fast_pop(arena_t * arena, int bin) {
+  
+  node_t * block = arena->fast[bin];
+  
+  arena->fast[bin] = block->next;
+  arena->fast_bytes -= SIZE(block);
+  block->head &= ~CACHED;
+  
+  return (void *)((char *)block + BLOCK_SIZE);
+}
+
+
+/* fast_consolidate: empties every quick list of the arena, freeing the blocks with free_block() so that
+ *                   they merge with each other and with the rest of the free space. Runs when an allocation
+ *                   finds nothing on the free list and in the tree, and when the lists reach fast_budget.
+ *                   The caller holds the lock.
+ */
+
+void fast_consolidate(arena_t * arena) {
+  
+  node_t * block;
+  node_t * nextPtr;
+  int bin;
+  
+  for (bin = 0; bin < FAST_BINS && arena->fast_bytes != 0; bin++) {
+    
+    for (block = arena->fast[bin]; block != NULL; block = nextPtr) {
+      
+      nextPtr = block->next;
+      arena->fast_bytes -= SIZE(block);
+      block->head &= ~CACHED;
+      free_block(arena, block);
+    }
+    
+    arena->fast[bin] = NULL;
+  }
+}
+
+
+/* myfree_batch: frees the n blocks in ptrs, which it sorts by address in place. Blocks of the same arena
+ *               are freed under one lock acquisition, and a run of blocks that sit next to each other in
+ *               memory is first turned into one block, so that it is coalesced and put back on the free list
+ *               once instead of once per block. Slab objects go back to their pages and mapped blocks are
+ *               unmapped. NULL entries are skipped.
+ *               Returns the number of blocks that could not be freed, 0 if all of them were.
+ */
+
+unsigned int myfree_batch(void ** ptrs, size_t n) {
+  
+  unsigned int failed = 0;
+  arena_t * held = NULL;
+  arena_t * arena;
+  node_t * firstPtr = NULL;
+  node_t * lastPtr;
+  size_t i;
+  size_t j;
+  
+  sort_ptrs(ptrs, n); // NULL sorts first, and the blocks of a run end up next to each other
+  
+  for (i = 0; i < n && ptrs[i] == NULL; i++);
+  
+  STAT(frees, n - i);
+  
+  for (i = 0; i < n; i = j) {
+    
+    j = i + 1;
+    
+    if (ptrs[i] == NULL) {
+      
+      continue;
+    }
+    
+    if (!IN_SLAB(ptrs[i])) {
+      
+      firstPtr = (node_t *)((char *)ptrs[i] - BLOCK_SIZE);
+      
+      if (!(__atomic_load_n(&firstPtr->head, __ATOMIC_RELAXED) & (CINUSE | PINUSE))) { // mapped on its own
+	
+	failed += mmap_free(firstPtr);
+	continue;
+      }
+    }
+    
+    arena = arena_of(ptrs[i]);
+    
+    if (arena != held) {
+      
+      if (held != NULL) {
+	
+	pthread_mutex_unlock(&held->lock);
+      }
+      
+      wait_lock(&arena->lock);
+      held = arena;
+    }
+    
+    if (!IN_SLAB(ptrs[i]) && (firstPtr->head & (CINUSE | CACHED)) == CINUSE) {
+      
+      lastPtr = firstPtr;
+      
+      while (j < n && ptrs[j] == (char *)NEXT_BLOCK(lastPtr) + BLOCK_SIZE &&
+	     (NEXT_BLOCK(lastPtr)->head & (CINUSE | CACHED)) == CINUSE) { // the next block is in the batch as well
+	
+	lastPtr = NEXT_BLOCK(lastPtr);
+	j++;
+      }
+      
+      firstPtr->head += (char *)NEXT_BLOCK(lastPtr) - (char *)NEXT_BLOCK(firstPtr); // the first block now spans the whole run
+    }
+    
+    failed += free_lock(ptrs[i]);
+  }
+  
+  if (held != NULL) {
+    
+    pthread_mutex_unlock(&held->lock);
+  }
+  
+  return failed;
+}
+
+
+/* sort_ptrs HELPER: sorts n pointers by address with an in-place heapsort, so that freeing a batch
+ *                   never needs any memory of its own
+ */
+
+void sort_ptrs(void ** ptrs, size_t n) {
+  
+  size_t i;
+  void * tmp;
+  
+  for (i = n / 2; i-- > 0; ) {
+    
+    sift_down(ptrs, i, n);
+  }
+  
+  for (i = n; i-- > 1; ) {
+    
+    tmp = ptrs[0];
+    ptrs[0] = ptrs[i];
+    ptrs[i] = tmp;
+    sift_down(ptrs, 0, i);
+  }
+}
+
+
+/* sift_down HELPER: moves ptrs[root] down the max-heap held in the first n entries of ptrs until
+ *                   neither of its children is larger
+ */
+
+void sift_down(void ** ptrs, size_t root, size_t n) {
+  
+  size_t child;
+  void * tmp;
+  
+  while ((child = 2 * root + 1) < n) {
+    
+    if (child + 1 < n && (uintptr_t)ptrs[child] < (uintptr_t)ptrs[child + 1]) {
+      
+      child++;
+    }
+    
+    if ((uintptr_t)ptrs[root] >= (uintptr_t)ptrs[child]) {
+      
+      return;
+    }
+    
+    tmp = ptrs[root];
+    ptrs[root] = ptrs[child];
+    ptrs[child] = tmp;
+    root = child;
+  }
+}
+
+
+/* trim_heap: gives the free space at the top of the arena's heap back to the OS once the free block
+ *            there is larger than trim_threshold. HEAP_TOP_KEEP bytes are kept so that the next
+ *            allocation does not have to grow the heap straight away, so a block without a whole page
+ *            beyond those is left alone whatever trim_threshold says. The main arena lowers the break
+ *            with a negative sbrk(), which only works if nobody else moved it since we did; the
+ *            other arenas unmap the tail of their mapping.
+ *            Returns 1 if the heap was trimmed and 0 otherwise.
+ */
+
+int trim_heap(arena_t * arena, node_t * block) {
+  
+  size_t release;
+  node_t * epilogue;
+  
+  if ((char *)NEXT_BLOCK(block) + BLOCK_SIZE != arena->heap_end || SIZE(block) <= trim_threshold ||
+      SIZE(block) < HEAP_TOP_KEEP + 4096) { // not the top block, or too small, or there is not a page past what we keep
+    
+    return 0;
+  }
+  
+  release = PAGE_DOWN(SIZE(block) - HEAP_TOP_KEEP);
+  
+  if (release == 0) {
+    
+    return 0;
+  }
+  
+  if (arena->index == 0) {
+    
+    if (sbrk(0) != arena->heap_end || sbrk(-(intptr_t)release) == (void *) -1) {
+      
+      return 0;
+    }
+  }
+  
+  else if (munmap(arena->heap_end - release, release) != 0) {
+    
+    return 0;
+  }
+  
+  if (arena->index == 0) {
+    
+    STAT(sbrks, 1);
+  }
+  
+  STAT(reserved, -release);
+  resize_free(arena, block, SIZE(block) - release);
+  
+  epilogue = NEXT_BLOCK(block); // the new end of the heap
+  epilogue->head = CINUSE | ARENA_BITS(arena);
+  arena->heap_end -= release;
+  
+  return 1;
+}
+
+
+/* release_pages: tells the OS it may take back the whole pages between start and end, which lie inside
+ *                a large free block. The addresses stay ours and read back as zeros the next time the
+ *                block is carved up, but they no longer count towards the resident set until then.
+ */
+
+void release_pages(char * start, char * end) {
+  
+  char * first = (char *)ALIGN_PAGE((uintptr_t)start);
+  char * last = (char *)PAGE_DOWN((uintptr_t)end);
+  
+  if (first < last) {
+    
+    madvise(first, last - first, MADV_DONTNEED);
+  }
+}
+
+
+/* tcache_get: takes a block of the size class of size out of this thread's cache without touching any
+ *             arena lock. When the bin is empty it is refilled with TCACHE_BATCH blocks carved from the
+ *             thread's arena under a single lock acquisition; one of them is returned to the caller.
+ *             Cached blocks are linked through their first payload word, so slab objects, which have no
+ *             header, are cached the same way as heap blocks.
+ *             Returns NULL if the heap could not supply any block.
+ */
+
+void * tcache_get(size_t size) {
+  
+  int bin = TCACHE_BIN(size); // the size of the blocks it holds, so freed blocks come back to the bin they left
+  int i;
+  node_t * block;
+  void * ptr;
+  arena_t * arena;
+  
+  if (tcache.bins[bin] == NULL) { // empty bin, refill it in one batch from the shared free list
+    
+    arena = arena_lock();
+    
+    for (i = 0; i < TCACHE_BATCH; i++) {
+      
+      ptr = malloc_lock(arena, bin << 3); // carve whole size classes so any block in the bin fits any request
+      
+      if (ptr == NULL) {
+	break;
+      }
+      
+      if (!IN_SLAB(ptr)) {
+	
+	((node_t *)((char *)ptr - BLOCK_SIZE))->head |= CACHED; // parked in the cache, coalesce() leaves it alone
+      }
+      
+      *(void **)ptr = tcache.bins[bin];
+      tcache.bins[bin] = ptr;
+      tcache.counts[bin]++;
+    }
+    
+    pthread_mutex_unlock(&arena->lock);
+    
+    if (tcache.bins[bin] == NULL) {
+      
+      return NULL;
+    }
+    
+    if (!tcache.registered) { // the cache now holds blocks, make sure they are returned when the thread exits
+      
+      pthread_setspecific(tcache_key, &tcache);
+      tcache.registered = 1;
+    }
+  }
+  
+  ptr = tcache.bins[bin];
+  tcache.bins[bin] = *(void **)ptr;
+  tcache.counts[bin]--;
+  
+  if (!IN_SLAB(ptr)) {
+    
+    block = (node_t *)((char *)ptr - BLOCK_SIZE);
+    __atomic_fetch_and(&block->head, ~(size_t)CACHED, __ATOMIC_RELAXED);
+  }
+  
+  else {
+    
+    ((void **)ptr)[1] = NULL; // handed out again, a later free may cache it
+  }
+  
+  return ptr;
+}
+
+
+/* tcache_put: parks an in-use block or slab object in bin of this thread's cache instead of freeing it.
+ *             A full bin first drains its oldest TCACHE_BATCH blocks back to their arenas with
+ *             tcache_release(), where they are coalesced as usual. Heap blocks are marked CACHED by the
+ *             caller, but a slab object has no header, so it is refused if its page has it free or if it
+ *             carries CACHE_KEY and is found in the bin already.
+ *             Returns 0 if the block was parked and 1 if it was free already.
+ */
+
+int tcache_put(void * ptr, int bin) {
+  
+  int i;
+  void * drainPtr;
+  void * prevPtr;
+  slab_t * slab;
+  unsigned int index;
+  
+  if (IN_SLAB(ptr)) {
+    
+    slab = SLAB_OF(ptr);
+    index = ((char *)ptr - (char *)slab - SLAB_HEADER) / slab->size;
+    
+    if (__atomic_load_n(&slab->map[index / 64], __ATOMIC_RELAXED) & (1UL << (index % 64))) { // back in its page
+      
+      return 1;
+    }
+    
+    if (((void **)ptr)[1] == CACHE_KEY) { // most likely parked already, make sure before refusing it
+      
+      for (prevPtr = tcache.bins[bin]; prevPtr != NULL; prevPtr = *(void **)prevPtr) {
+	
+	if (prevPtr == ptr) {
+	  
+	  return 1;
+	}
+      }
+    }
+  }
+  
+  if (tcache.counts[bin] >= TCACHE_COUNT) { // bin is full, hand the tail of it back to the shared heap
+    
+    prevPtr = tcache.bins[bin];
+    
+    for (i = 1; i < TCACHE_COUNT - TCACHE_BATCH; i++) { // keep the most recently freed blocks, they are the warmest
+      
+      prevPtr = *(void **)prevPtr;
+    }
+    
+    drainPtr = *(void **)prevPtr;
+    *(void **)prevPtr = NULL;
+    tcache.counts[bin] -= TCACHE_BATCH;
+    
+    tcache_release(drainPtr);
+  }
+  
+  if (!tcache.registered) {
+    
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = 1;
+  }
+  
+  *(void **)ptr = tcache.bins[bin];
+  tcache.bins[bin] = ptr;
+  tcache.counts[bin]++;
+  
+  if (IN_SLAB(ptr)) {
+    
+    ((void **)ptr)[1] = CACHE_KEY;
+  }
+  
+  return 0;
+}
+
+
+/* tcache_flush: destructor for tcache_key. Runs when a thread exits and returns every block parked
+ *               in its cache to the shared free list so short lived threads do not leak memory.
+ */
+
+void tcache_flush(void * cache) {
+  
+  tcache_t * tc = (tcache_t *)cache;
+  int bin;
+  
+  for (bin = 0; bin < TCACHE_BINS; bin++) {
+    
+    tcache_release(tc->bins[bin]);
+    tc->bins[bin] = NULL;
+    tc->counts[bin] = 0;
+  }
+  
+  tc->registered = 0;
+}
+
+
+/* tcache_release: frees a chain of cached blocks linked through their first payload word. Each block
+ *                 goes back to the arena it came from; consecutive blocks of the same arena share one
+ *                 lock acquisition, and blocks of arenas other than the thread's own go on their remote
+ *                 stacks without taking a lock at all.
+ */
+
+void tcache_release(void * ptr) {
+  
+  arena_t * held = NULL;
+  arena_t * arena;
+  void * nextPtr;
+  
+  while (ptr != NULL) {
+    
+    nextPtr = *(void **)ptr;
+    arena = arena_of(ptr);
+    
+    if (arena != thread_arena) { // still marked as cached, remote_drain() takes it from there
+      
+      remote_push(arena, ptr);
+      ptr = nextPtr;
+      continue;
+    }
+    
+    if (arena != held) {
+      
+      if (held != NULL) {
+	
+	pthread_mutex_unlock(&held->lock);
+      }
+      
+      wait_lock(&arena->lock);
+      held = arena;
+    }
+    
+    if (!IN_SLAB(ptr)) {
+      
+      ((node_t *)((char *)ptr - BLOCK_SIZE))->head &= ~CACHED; // in use again as far as free_lock() is concerned
+    }
+    
+    free_lock(ptr);
+    ptr = nextPtr;
+  }
+  
+  if (held != NULL) {
+    
+    pthread_mutex_unlock(&held->lock);
+  }
+}
+
+
+/* remote_push: hands a block or slab object over to the arena it belongs to without taking the arena's
+ *              lock, by pushing it on the arena's remote stack with a compare and swap. The push only has
+ *              to retry when another thread changed the stack in between, so it is lock-free, though not
+ *              wait-free. The block stays marked as cached until remote_drain() frees it.
+ */
+
+void remote_push(arena_t * arena, void * ptr) {
+  
+  void * head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+  
+  do {
+    
+    *(void **)ptr = head;
+    
+  } while (!__atomic_compare_exchange_n(&arena->remote, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/* remote_drain: frees every block other threads left on the arena's remote stack. The whole stack is
+ *               taken with a single atomic exchange, so the stack never has a block popped off its top
+ *               while others are pushed and pushes can carry on meanwhile. The caller holds the lock.
+ */
+
+void remote_drain(arena_t * arena) {
+  
+  void * ptr;
+  void * nextPtr;
+  
+  ptr = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+  
+  while (ptr != NULL) {
+    
+    nextPtr = *(void **)ptr;
+    
+    if (!IN_SLAB(ptr)) {
+      
+      ((node_t *)((char *)ptr - BLOCK_SIZE))->head &= ~CACHED;
+    }
+    
+    free_lock(ptr);
+    ptr = nextPtr;
+  }
+}
+
+
+/* arena_of: returns the arena a heap block or slab object belongs to, whose lock free_lock() needs
+ */
+
+arena_t * arena_of(void * ptr) {
+  
+  if (IN_SLAB(ptr)) {
+    
+    return &arenas[SLAB_OF(ptr)->arena];
+  }
+  
+  return &arenas[__atomic_load_n(&((node_t *)((char *)ptr - BLOCK_SIZE))->head, __ATOMIC_RELAXED) >> ARENA_SHIFT];
+}
+
+
+/* mmap_alloc: serves a large request with a private anonymous mapping holding just a header and the
+ *             payload, so it never walks or fragments an arena's free list. Neither in-use bit is set
+ *             in the header, which no heap block looks like, so that myfree() knows to munmap() it.
+ *             The payload starts at the first multiple of alignment past the header; the mapping is made
+ *             large enough for any placement and the whole pages in front of the header and past the
+ *             payload are unmapped again.
+ *             Returns NULL on error.
+ */
+
+void * mmap_alloc(size_t size, size_t alignment) {
+  
+  char * base;
+  node_t * block;
+  uintptr_t payload;
+  size_t length;
+  size_t lead;
+  size_t used;
+  
+  if (alignment < ALIGNMENT) {
+    
+    alignment = ALIGNMENT;
+  }
+  
+  if (size > SIZE_MAX - alignment - 4096) { // the page rounding below would wrap around
+    
+    return NULL;
+  }
+  
+  length = ALIGN_PAGE(size + alignment);
+  base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  
+  if (base == MAP_FAILED) {
+    
+    return NULL;
+  }
+  
+  payload = ALIGN_UP((uintptr_t)base + BLOCK_SIZE, alignment);
+  block = (node_t *)(payload - BLOCK_SIZE);
+  lead = PAGE_DOWN((uintptr_t)block - (uintptr_t)base);
+  used = ALIGN_PAGE(payload + size - (uintptr_t)base);
+  
+  if (lead > 0) {
+    
+    munmap(base, lead);
+  }
+  
+  if (used < length) {
+    
+    munmap(base + used, length - used);
+  }
+  
+  STAT(mmaps, 1);
+  STAT(reserved, used - lead);
+  
+  block->head = ALIGN8(size); // no flags means in use and mapped on its own
+  
+  return (void *)payload;
+}
+
+
+/* mmap_free: unmaps a block handed out by mmap_alloc(), from the page holding its header to the end of
+ *            its payload. Returns 0 if the memory was successfully freed and 1 otherwise.
+ */
+
+unsigned int mmap_free(node_t * block) {
+  
+  uintptr_t start = PAGE_DOWN((uintptr_t)block);
+  size_t length = ALIGN_PAGE((uintptr_t)block + BLOCK_SIZE + SIZE(block)) - start;
+  
+  if (munmap((void *)start, length) != 0) {
+    
+    return 1;
+  }
+  
+  STAT(reserved, -length);
+  
+  return 0;
+}
+
+
+/* mmap_resize: resizes a block handed out by mmap_alloc() with mremap(), which may move the mapping to
+ *              a new address but never copies the pages. The header keeps its offset into the first page.
+ *              Returns the new payload or NULL if the mapping could not be resized.
+ */
+
+void * mmap_resize(node_t * block, size_t size) {
+  
+  uintptr_t start = PAGE_DOWN((uintptr_t)block);
+  size_t offset = (uintptr_t)block - start;
+  size_t length = ALIGN_PAGE((uintptr_t)block + BLOCK_SIZE + SIZE(block)) - start;
+  char * base;
+  
+  base = mremap((void *)start, length, ALIGN_PAGE(offset + BLOCK_SIZE + size), MREMAP_MAYMOVE);
+  
+  if (base == MAP_FAILED) {
+    
+    return NULL;
+  }
+  
+  STAT(reserved, ALIGN_PAGE(offset + BLOCK_SIZE + size) - length);
+  
+  block = (node_t *)(base + offset);
+  block->head = ALIGN8(size); // still no flags, still mapped on its own
+  
+  return (void *)((char *)block + BLOCK_SIZE);
+}
+
+
+/* slab_alloc: hands out an object of the size class of size from one of the arena's slab pages. All the
+ *             objects in a page are the same size, so the page only keeps a bitmap of which of them are
+ *             free and no object carries a header of its own. When the arena has no page of the class
+ *             with room left a new one comes from slab_page(). The caller holds the arena's lock.
+ *             Returns NULL once the slab range is used up.
+ */
+
+void * slab_alloc(arena_t * arena, size_t size) {
+  
+  slab_t * slab;
+  int word;
+  int bit;
+  
+  slab = arena->slabs[SLAB_CLASS(size)];
+  
+  if (slab == NULL) {
+    
+    slab = slab_page(arena, (SLAB_CLASS(size) + 1) << 4);
+    
+    if (slab == NULL) {
+      
+      return NULL;
+    }
+  }
+  
+  for (word = 0; slab->map[word] == 0; word++); // every page on the list has a free object
+  
+  bit = __builtin_ctzl(slab->map[word]);
+  slab->map[word] &= ~(1UL << bit);
+  slab->used++;
+  
+  if (slab->used == slab->count) { // full pages leave the list until one of their objects is freed
+    
+    slab_unlink(arena, slab);
+  }
+  
+  return (char *)slab + SLAB_HEADER + (word * 64 + bit) * slab->size;
+}
+
+
+/* slab_free: gives a slab object back to its page. The caller holds the lock of the page's arena.
+ *            A full page goes back on the arena's list, and a page left empty is given back to the
+ *            OS and the shared pool unless it is the only page of its class the arena has room in.
+ *            Returns 0 if the object was successfully freed and 1 if it was already free.
+ */
+
+unsigned int slab_free(void * ptr) {
+  
+  slab_t * slab = SLAB_OF(ptr);
+  arena_t * arena = &arenas[slab->arena];
+  unsigned int index;
+  
+  index = ((char *)ptr - (char *)slab - SLAB_HEADER) / slab->size;
+  
+  if (slab->map[index / 64] & (1UL << (index % 64))) {
+    
+    return 1;
+  }
+  
+  if (slab->used == slab->count) {
+    
+    slab_push(arena, slab);
+  }
+  
+  slab->map[index / 64] |= 1UL << (index % 64);
+  slab->used--;
+  
+  if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL)) { // keep one empty page so a class does not thrash
+    
+    slab_unlink(arena, slab);
+    madvise(slab, SLAB_PAGE, MADV_DONTNEED);
+    STAT(reserved, -SLAB_PAGE);
+    
+    wait_lock(&slab_lock);
+    slab_pool[slab_pooled++] = ((char *)slab - slab_base) / SLAB_PAGE;
+    pthread_mutex_unlock(&slab_lock);
+  }
+  
+  return 0;
+}
+
+
+/* slab_page: takes an empty page for objects of size bytes, either one that an arena gave back or the
+ *            next untouched page of the slab range, marks all of its objects free and puts it on the
+ *            arena's list. Returns NULL when the range is used up.
+ */
+
+slab_t * slab_page(arena_t * arena, size_t size) {
+  
+  slab_t * slab = NULL;
+  int i;
+  
+  wait_lock(&slab_lock);
+  
+  if (slab_pooled > 0) {
+    
+    slab = (slab_t *)(slab_base + (size_t)slab_pool[--slab_pooled] * SLAB_PAGE);
+  }
+  
+  else if (slab_next < SLAB_REGION) {
+    
+    slab = (slab_t *)(slab_base + slab_next);
+    slab_next += SLAB_PAGE;
+  }
+  
+  pthread_mutex_unlock(&slab_lock);
+  
+  if (slab == NULL) {
+    
+    return NULL;
+  }
+  
+  STAT(reserved, SLAB_PAGE);
+  slab->size = size;
+  slab->count = (SLAB_PAGE - SLAB_HEADER) / size;
+  slab->used = 0;
+  slab->arena = arena->index;
+  memset(slab->map, 0, sizeof(slab->map));
+  
+  for (i = 0; i < slab->count / 64; i++) {
+    
+    slab->map[i] = ~0UL;
+  }
+  
+  if (slab->count % 64) {
+    
+    slab->map[i] = (1UL << (slab->count % 64)) - 1;
+  }
+  
+  slab_push(arena, slab);
+  
+  return slab;
+}
+
+
+/* slab_push HELPER: inserts a slab page at the front of the arena's list for its size class
+ */
+
+void slab_push(arena_t * arena, slab_t * slab) {
+  
+  slab_t ** head = &arena->slabs[SLAB_CLASS(slab->size)];
+  
+  slab->prev = NULL;
+  slab->next = *head;
+  
+  if (*head != NULL) {
+    
+    (*head)->prev = slab;
+  }
+  
+  *head = slab;
+}
+
+
+/* slab_unlink HELPER: removes a slab page from anywhere in the arena's list for its size class
+ */
+
+void slab_unlink(arena_t * arena, slab_t * slab) {
+  
+  if (slab->prev != NULL) {
+    
+    slab->prev->next = slab->next;
+  }
+  
+  else {
+    
+    arena->slabs[SLAB_CLASS(slab->size)] = slab->next;
+  }
+  
+  if (slab->next != NULL) {
+    
+    slab->next->prev = slab->prev;
+  }
+  
+  slab->prev = NULL;
+  slab->next = NULL;
+}
@@ -0,0 +1,242 @@
+/* The simulated address space the allocator runs on inside simulate. The
+ * break grows up from the start of the reservation; mappings are placed first
+ * fit in the rest, in address order, so where they land only depends on the
+ * calls made before. Memory given back is dropped with MADV_DONTNEED, which
+ * keeps the real footprint down and makes it read back as zero the next time
+ * it is handed out, as fresh memory from the OS would.
+ */
+
+#define _GNU_SOURCE // for MAP_FIXED_NOREPLACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "simcore.h"
+
+#define PAGE 4096
+#define PAGE_UP(x) (((x) + PAGE - 1) & ~(size_t)(PAGE - 1))
+
+// A run of free address space among the mappings
+struct extent {
+	char *start;
+	size_t length;
+};
+
+char *sim_base = NULL;
+char *sim_break = NULL;
+char *sim_break_end = NULL;
+
+// Free extents of the mapping area, sorted by address and never adjacent
+struct extent *extents = NULL;
+size_t num_extents = 0;
+size_t max_extents = 0;
+
+int sim_init(void)
+{
+	sim_base = mmap(SIM_BASE, SIM_SPACE, PROT_READ | PROT_WRITE,
+	                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+	if (sim_base == MAP_FAILED) {
+		// an older kernel, or the address is taken; the run is still repeatable, only the addresses differ
+		sim_base = mmap(NULL, SIM_SPACE, PROT_READ | PROT_WRITE,
+		                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	}
+	if (sim_base == MAP_FAILED) {
+		perror("Simulated core mmap");
+		return -1;
+	}
+	sim_break = sim_base;
+	sim_break_end = sim_base + SIM_BREAK_SPACE;
+
+	max_extents = 64;
+	extents = malloc(max_extents * sizeof(struct extent));
+	if (!extents) {
+		return -1;
+	}
+	extents[0].start = sim_break_end;
+	extents[0].length = SIM_SPACE - SIM_BREAK_SPACE;
+	num_extents = 1;
+	return 0;
+}
+
+void *sim_sbrk(intptr_t increment)
+{
+	char *old = sim_break;
+	if (increment > 0 && (size_t)increment > (size_t)(sim_break_end - sim_break)) {
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+	if (increment < 0) {
+		if ((size_t)-increment > (size_t)(sim_break - sim_base)) {
+			errno = EINVAL;
+			return (void *)-1;
+		}
+		// only the whole pages past the new break can go
+		char *keep = sim_base + PAGE_UP((size_t)(sim_break + increment - sim_base));
+		if (keep < sim_break) {
+			madvise(keep, sim_break - keep, MADV_DONTNEED);
+		}
+	}
+	sim_break += increment;
+	return old;
+}
+
+// First extent ending past addr
+size_t find_extent(char *addr)
+{
+	size_t lo = 0, hi = num_extents, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (extents[mid].start + extents[mid].length <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Take [start, start + length) out of extent i, which holds all of it
+void carve(size_t i, char *start, size_t length)
+{
+	struct extent *e = &extents[i];
+	char *end = start + length, *e_end = e->start + e->length;
+
+	if (start > e->start && end < e_end) {
+		// splits the extent in two
+		if (num_extents == max_extents) {
+			max_extents *= 2;
+			extents = realloc(extents, max_extents * sizeof(struct extent));
+			if (!extents) {
+				fprintf(stderr, "Simulated core: out of memory\n");
+				exit(1);
+			}
+			e = &extents[i];
+		}
+		memmove(e + 2, e + 1, (num_extents - i - 1) * sizeof(struct extent));
+		num_extents++;
+		e[1].start = end;
+		e[1].length = e_end - end;
+		e->length = start - e->start;
+	} else if (start > e->start) {
+		e->length = start - e->start;
+	} else if (end < e_end) {
+		e->start = end;
+		e->length = e_end - end;
+	} else {
+		memmove(e, e + 1, (num_extents - i - 1) * sizeof(struct extent));
+		num_extents--;
+	}
+}
+
+// Whether [start, start + length) is free, and in which extent
+int is_free(char *start, size_t length, size_t *i)
+{
+	*i = find_extent(start);
+	return *i < num_extents && extents[*i].start <= start &&
+	       start + length <= extents[*i].start + extents[*i].length;
+}
+
+void *sim_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	size_t i;
+	char *start = addr;
+
+	if (fd != -1 || !(flags & MAP_ANONYMOUS) || length == 0) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	length = PAGE_UP(length);
+	// a hint is taken if the range is free, as the kernel would
+	if (!start || (size_t)start % PAGE || !is_free(start, length, &i)) {
+		for (i = 0; i < num_extents && extents[i].length < length; i++);
+		if (i == num_extents) {
+			errno = ENOMEM;
+			return MAP_FAILED;
+		}
+		start = extents[i].start;
+	}
+	carve(i, start, length);
+	return start;
+}
+
+int sim_munmap(void *addr, size_t length)
+{
+	char *start = addr, *end;
+	size_t i;
+
+	if ((size_t)start % PAGE || start < sim_break_end || start >= sim_base + SIM_SPACE) {
+		errno = EINVAL;
+		return -1;
+	}
+	length = PAGE_UP(length);
+	end = start + length;
+	madvise(start, length, MADV_DONTNEED);
+
+	// the extents before and after the range, which it may join
+	i = find_extent(start);
+	if (i < num_extents && extents[i].start < end) {
+		// parts of it are not mapped, which munmap() allows but the allocator never does
+		errno = EINVAL;
+		return -1;
+	}
+	if (i > 0 && extents[i - 1].start + extents[i - 1].length == start) {
+		extents[i - 1].length += length;
+		if (i < num_extents && extents[i].start == end) {
+			extents[i - 1].length += extents[i].length;
+			memmove(&extents[i], &extents[i + 1], (num_extents - i - 1) * sizeof(struct extent));
+			num_extents--;
+		}
+		return 0;
+	}
+	if (i < num_extents && extents[i].start == end) {
+		extents[i].start = start;
+		extents[i].length += length;
+		return 0;
+	}
+	if (num_extents == max_extents) {
+		max_extents *= 2;
+		extents = realloc(extents, max_extents * sizeof(struct extent));
+		if (!extents) {
+			fprintf(stderr, "Simulated core: out of memory\n");
+			exit(1);
+		}
+	}
+	memmove(&extents[i + 1], &extents[i], (num_extents - i) * sizeof(struct extent));
+	num_extents++;
+	extents[i].start = start;
+	extents[i].length = length;
+	return 0;
+}
+
+// Grows in place when the pages after the mapping are free, and otherwise moves it by copying
+void *sim_mremap(void *old, size_t old_length, size_t new_length, int flags)
+{
+	char *start = old, *moved;
+	size_t i;
+
+	old_length = PAGE_UP(old_length);
+	new_length = PAGE_UP(new_length);
+	if (new_length <= old_length) {
+		if (new_length < old_length) {
+			sim_munmap(start + new_length, old_length - new_length);
+		}
+		return start;
+	}
+	if (is_free(start + old_length, new_length - old_length, &i)) {
+		carve(i, start + old_length, new_length - old_length);
+		return start;
+	}
+	if (!(flags & MREMAP_MAYMOVE)) {
+		errno = ENOMEM;
+		return MAP_FAILED;
+	}
+	moved = sim_mmap(NULL, new_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (moved == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+	memcpy(moved, start, old_length);
+	sim_munmap(start, old_length);
+	return moved;
+}
@@ -0,0 +1,26 @@
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A simulated address space for simulate. The allocator is built a second
+ * time with -DSIMULATE, which sends its calls to sbrk(), mmap(), munmap() and
+ * mremap() here. The simulated break and mappings are carved out of one large
+ * reservation at a fixed address, so the same trace puts every block at the
+ * same address on every run and the allocator's choices repeat exactly.
+ */
+
+#define SIM_BASE ((char *)0x200000000000) // where the reservation is asked for, anywhere else will do
+#define SIM_SPACE ((size_t)1 << 36)        // bytes reserved, only pages the allocator touches use memory
+#define SIM_BREAK_SPACE ((size_t)1 << 34)  // the first part is what the break can grow into, mappings get the rest
+
+int sim_init(void); // Returns 0 on success and -1 on error.
+void *sim_sbrk(intptr_t increment);
+void *sim_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int sim_munmap(void *addr, size_t length);
+void *sim_mremap(void *old, size_t old_length, size_t new_length, int flags);
+
+#ifdef SIMULATE
+#define sbrk sim_sbrk
+#define mmap sim_mmap
+#define munmap sim_munmap
+#define mremap sim_mremap
+#endif
@@ -0,0 +1,364 @@
+/* Replays a trace in a single thread against a simulated address space, so
+ * that what the allocator does with it is the same on every run and on every
+ * machine. The trace's threads take turns, quantum operations at a time, and
+ * each keeps its own arena and thread cache as it would in test_malloc; a
+ * thread waiting on an empty channel passes its turn on. Nothing is timed but
+ * the replay as a whole, which makes sweeping policies and thresholds over a
+ * trace a matter of seconds.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "memory.h"
+#include "trace.h"
+#include "simcore.h"
+
+// The allocator's per thread state, swapped whenever another trace thread takes its turn
+extern __thread arena_t *thread_arena;
+extern __thread tcache_t tcache;
+
+// The counters of the one real thread, whose reserved bytes are the footprint
+extern __thread thread_stats_t stats;
+
+// What each trace thread keeps between its turns
+struct sim_thread {
+	struct trace_op *op; // the next one to replay
+	uint64_t left;
+	char **blocks; // slot i holds the block the trace calls i, NULL once freed
+	uint32_t *sizes; // bytes asked for, 0 once freed
+	arena_t *arena;
+	tcache_t tcache;
+};
+
+// Blocks on their way from one trace thread to another
+struct sim_channel {
+	char **blocks;
+	uint32_t *sizes;
+	uint64_t put;
+	uint64_t got;
+};
+
+struct trace trace;
+struct sim_thread *threads;
+struct sim_channel *channels;
+long current = -1; // whose arena and cache the allocator sees
+
+uint64_t ops_done = 0;
+uint64_t interval = 0; // operations between samples, 0 for none
+uint64_t failures = 0;
+size_t live = 0; // bytes asked for in the blocks still live
+size_t peak_live = 0;
+size_t peak_footprint = 0;
+double sample_ns = 0; // spent sampling, which the replay time leaves out
+
+double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void switch_to(long t)
+{
+	if (current == t) {
+		return;
+	}
+	if (current >= 0) {
+		threads[current].arena = thread_arena;
+		threads[current].tcache = tcache;
+	}
+	thread_arena = threads[t].arena;
+	tcache = threads[t].tcache;
+	current = t;
+}
+
+// Free space in the heaps and the largest free block
+void walk_free(void *ptr, size_t size, int state, void *arg)
+{
+	size_t *free_bytes = arg;
+	if (state != HEAP_FREE) {
+		return;
+	}
+	free_bytes[0] += size;
+	if (size > free_bytes[1]) {
+		free_bytes[1] = size;
+	}
+}
+
+// Print a row of the fragmentation table
+void sample()
+{
+	double t0 = now_ns();
+	size_t free_bytes[2] = {0, 0};
+	size_t footprint = stats.counts.reserved;
+
+	mymalloc_heapwalk(walk_free, free_bytes);
+	fprintf(stdout, "%12lu %14zu %14zu %13.3f %8.3f\n", (unsigned long)ops_done, footprint, live,
+	        footprint ? 1.0 - (double)live / footprint : 0.0,
+	        free_bytes[0] ? 1.0 - (double)free_bytes[1] / free_bytes[0] : 0.0);
+	sample_ns += now_ns() - t0;
+}
+
+void failed(long id, const char *what, struct trace_op *op)
+{
+	fprintf(stderr, "[%li]: error on %s of block %u\n", id, what, op->index);
+	failures++;
+}
+
+// Replay the thread's next operation; returns 1 instead if it has to wait for a block
+int step(long id)
+{
+	struct sim_thread *t = &threads[id];
+	struct trace_op *op = t->op;
+	struct sim_channel *ch;
+	char *ptr;
+	uint32_t j, n;
+
+	switch (op->type) {
+	case MALLOC:
+		ptr = mymalloc(op->size);
+		if (!ptr) {
+			failed(id, "malloc", op);
+			break;
+		}
+		t->blocks[op->index] = ptr;
+		t->sizes[op->index] = op->size;
+		live += op->size;
+		break;
+
+	case MEMALIGN:
+		ptr = mymemalign(op->align, op->size);
+		if (!ptr) {
+			failed(id, "memalign", op);
+			break;
+		}
+		t->blocks[op->index] = ptr;
+		t->sizes[op->index] = op->size;
+		live += op->size;
+		break;
+
+	case CALLOC:
+		ptr = mycalloc(op->count, op->size);
+		if (!ptr) {
+			failed(id, "calloc", op);
+			break;
+		}
+		t->blocks[op->index] = ptr;
+		t->sizes[op->index] = op->count * op->size;
+		live += op->count * op->size;
+		break;
+
+	case MALLOC_BATCH:
+		n = mymalloc_batch(op->size, op->count, (void **)&t->blocks[op->index]);
+		if (n < op->count) {
+			failed(id, "malloc batch", op);
+		}
+		for (j = op->index; j < op->index + n; j++) {
+			t->sizes[j] = op->size;
+		}
+		live += (size_t)n * op->size;
+		break;
+
+	case REALLOC:
+		ptr = myrealloc(t->blocks[op->index], op->size);
+		if (!ptr) {
+			failed(id, "realloc", op);
+			break;
+		}
+		live += op->size;
+		live -= t->sizes[op->index];
+		t->blocks[op->index] = ptr;
+		t->sizes[op->index] = op->size;
+		break;
+
+	case FREE:
+	case FREE_SIZED:
+		ptr = t->blocks[op->index];
+		if (op->type == FREE ? myfree(ptr) : myfree_sized(ptr, t->sizes[op->index])) {
+			failed(id, "free", op);
+		}
+		live -= t->sizes[op->index];
+		t->blocks[op->index] = NULL;
+		t->sizes[op->index] = 0;
+		break;
+
+	case FREE_BATCH:
+		for (j = op->index; j < op->index + op->count; j++) {
+			live -= t->sizes[j];
+			t->sizes[j] = 0;
+		}
+		if (myfree_batch((void **)&t->blocks[op->index], op->count)) {
+			failed(id, "free batch", op);
+		}
+		memset(&t->blocks[op->index], 0, op->count * sizeof(char *));
+		break;
+
+	case PUT:
+		ch = &channels[op->channel];
+		ch->blocks[ch->put] = t->blocks[op->index];
+		ch->sizes[ch->put] = t->sizes[op->index];
+		ch->put++;
+		t->blocks[op->index] = NULL;
+		t->sizes[op->index] = 0;
+		break;
+
+	case GET:
+		ch = &channels[op->channel];
+		if (ch->got == ch->put) {
+			return 1;
+		}
+		t->blocks[op->index] = ch->blocks[ch->got];
+		t->sizes[op->index] = ch->sizes[ch->got];
+		ch->got++;
+		break;
+
+	default:
+		fprintf(stderr, "Error: bad instruction\n");
+		exit(1);
+	}
+
+	ops_done++;
+	if (stats.counts.reserved > peak_footprint) {
+		peak_footprint = stats.counts.reserved;
+	}
+	if (live > peak_live) {
+		peak_live = live;
+	}
+	if (interval && ops_done % interval == 0) {
+		sample();
+	}
+	return 0;
+}
+
+void *alloc_zeroed(size_t n, size_t size)
+{
+	void *p = calloc(n ? n : 1, size);
+	if (!p) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+void usage(char *argv[])
+{
+	printf("Usage: %s -f <trace file> [-p <policy> -a <arenas> -q <ops> -i <ops>]\n", argv[0]);
+	printf("\t-p : placement policy: first, next, best or address\n");
+	printf("\t-a : number of arenas, 1 by default so that the result does not depend on the machine\n");
+	printf("\t-q : operations a thread replays before the next one takes its turn, 64 by default\n");
+	printf("\t-i : operations between rows of the fragmentation table, 0 for none;\n");
+	printf("\t     by default the replay is sampled 20 times\n");
+	printf("The other MYMALLOC_ variables are read as usual.\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	char *path = NULL;
+	int option;
+	long quantum = 64, t, k;
+	long long samples = -1;
+	uint64_t total = 0, unfinished = 0;
+	int progress;
+	double t0, elapsed;
+
+	if (!getenv("MYMALLOC_ARENAS")) {
+		setenv("MYMALLOC_ARENAS", "1", 1);
+	}
+	while ((option = getopt(argc, argv, "f:p:a:q:i:h")) != -1) {
+		switch (option) {
+		case 'f':
+			path = optarg;
+			break;
+		case 'p':
+			setenv("MYMALLOC_POLICY", optarg, 1);
+			break;
+		case 'a':
+			setenv("MYMALLOC_ARENAS", optarg, 1);
+			break;
+		case 'q':
+			quantum = atol(optarg);
+			break;
+		case 'i':
+			samples = atoll(optarg);
+			break;
+		default:
+			usage(argv);
+		}
+	}
+	if (path == NULL || quantum < 1 || samples < -1) {
+		usage(argv);
+	}
+
+	if (trace_open(path, &trace)) {
+		return 1;
+	}
+	threads = alloc_zeroed(trace.num_threads, sizeof(struct sim_thread));
+	for (t = 0; t < trace.num_threads; t++) {
+		threads[t].op = trace_ops(&trace, t);
+		threads[t].left = trace.threads[t].num_ops;
+		threads[t].blocks = alloc_zeroed(trace.threads[t].num_locations, sizeof(char *));
+		threads[t].sizes = alloc_zeroed(trace.threads[t].num_locations, sizeof(uint32_t));
+		total += threads[t].left;
+		unfinished += threads[t].left > 0;
+	}
+	channels = alloc_zeroed(trace.num_channels, sizeof(struct sim_channel));
+	for (t = 0; t < trace.num_channels; t++) {
+		channels[t].blocks = alloc_zeroed(trace.channels[t].puts, sizeof(char *));
+		channels[t].sizes = alloc_zeroed(trace.channels[t].puts, sizeof(uint32_t));
+	}
+	interval = samples >= 0 ? (uint64_t)samples : (total >= 20 ? total / 20 : 1);
+
+	if (sim_init() || mymalloc_init()) {
+		fprintf(stderr, "Error: mymalloc_init failed\n");
+		return 1;
+	}
+
+	if (interval) {
+		fprintf(stdout, "%12s %14s %14s %13s %8s\n", "Ops", "Footprint", "Live", "Fragmentation", "External");
+	}
+	t0 = now_ns();
+	while (unfinished) {
+		progress = 0;
+		for (t = 0; t < trace.num_threads; t++) {
+			if (!threads[t].left) {
+				continue;
+			}
+			switch_to(t);
+			for (k = 0; k < quantum && threads[t].left; k++) {
+				if (step(t)) {
+					break;
+				}
+				threads[t].op++;
+				progress = 1;
+				if (--threads[t].left == 0) {
+					unfinished--;
+				}
+			}
+		}
+		if (!progress) {
+			fprintf(stderr, "Error: every thread left is waiting on a channel\n");
+			return 1;
+		}
+	}
+	elapsed = now_ns() - t0 - sample_ns;
+
+	fprintf(stdout, "Ops: %lu\n", (unsigned long)ops_done);
+	fprintf(stdout, "Time: %f\n", elapsed / 1000);
+	fprintf(stdout, "Ops per second: %.0f\n", elapsed > 0 ? ops_done / (elapsed / 1e9) : 0.0);
+	fprintf(stdout, "Peak footprint: %zu\n", peak_footprint);
+	fprintf(stdout, "Peak live: %zu\n", peak_live);
+	fprintf(stdout, "Peak overhead: %.3f\n", peak_footprint ? 1.0 - (double)peak_live / peak_footprint : 0.0);
+	fprintf(stdout, "Final footprint: %zu\n", (size_t)stats.counts.reserved);
+	fprintf(stdout, "Final live: %zu\n", live);
+	if (failures) {
+		fprintf(stdout, "Failed operations: %lu\n", (unsigned long)failures);
+	}
+	return failures != 0;
+}
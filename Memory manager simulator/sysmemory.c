@@ -1,43 +1,128 @@
-#include <stdlib.h>
-#include <stdio.h>
-
-/* Uses the system malloc and free.  This is for testing and comparison 
- * purposes only.
- */
-
-/* mymalloc_init: initialize any data structures that your malloc needs in
-                  order to keep track of allocated and free blocks of
-                  memory.  Get an initial chunk of memory for the heap from
-                  the OS using sbrk() and mark it as free so that it can  be
-                  used in future calls to mymalloc()
-*/
-
-int mymalloc_init() {
-        return 0; // Nothing to do here for system malloc.
-}
-
-
-/* mymalloc: allocates memory on the heap of the requested size. The block
-             of memory returned should always be padded so that it begins
-             and ends on a word boundary.
-     unsigned int size: the number of bytes to allocate.
-     retval: a pointer to the block of memory allocated or NULL if the 
-             memory could not be allocated. 
-             (NOTE: the system also sets errno, but we are not the system, 
-                    so you are not required to do so.)
-*/
-void *mymalloc(unsigned int size) {
-    return malloc(size);
-}
-
-/* myfree: unallocates memory that has been allocated with mymalloc.
-     void *ptr: pointer to the first byte of a block of memory allocated by 
-                mymalloc.
-     retval: 0 if the memory was successfully freed and 1 otherwise.
-             (NOTE: the system version of free returns no error.)
-*/
-unsigned int myfree(void *ptr) {
-    free(ptr);
-    return 0;
-}
-
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include "memory.h"
+
+/* Uses the system malloc and free.  This is for testing and comparison 
+ * purposes only.
+ */
+
+/* mymalloc_init: initialize any data structures that your malloc needs in
+                  order to keep track of allocated and free blocks of
+                  memory.  Get an initial chunk of memory for the heap from
+                  the OS using sbrk() and mark it as free so that it can  be
+                  used in future calls to mymalloc()
+*/
+
+int mymalloc_init() {
+        return 0; // Nothing to do here for system malloc.
+}
+
+
+/* mymalloc: allocates memory on the heap of the requested size. The block
+             of memory returned should always be padded so that it begins
+             and ends on a word boundary.
+     size_t size: the number of bytes to allocate.
+     retval: a pointer to the block of memory allocated or NULL if the 
+             memory could not be allocated. 
+             (NOTE: the system also sets errno, but we are not the system, 
+                    so you are not required to do so.)
+*/
+void *mymalloc(size_t size) {
+    return malloc(size);
+}
+
+/* mymemalign: allocates size bytes at an address that is a multiple of
+               alignment, a power of two.
+     retval: a pointer to the block or NULL on error.
+*/
+void *mymemalign(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+/* myposix_memalign: like mymemalign, but stores the block in *memptr.
+     retval: 0 on success, EINVAL for a bad alignment, ENOMEM otherwise.
+*/
+int myposix_memalign(void **memptr, size_t alignment, size_t size) {
+    return posix_memalign(memptr, alignment, size);
+}
+
+/* mycalloc: allocates zeroed memory for n elements of size bytes each.
+     retval: a pointer to the block or NULL on error.
+*/
+void *mycalloc(size_t n, size_t size) {
+    return calloc(n, size);
+}
+
+/* myrealloc: resizes the block at ptr to size bytes, moving it if needed.
+     retval: a pointer to the block or NULL on error.
+*/
+void *myrealloc(void *ptr, size_t size) {
+    return realloc(ptr, size);
+}
+
+/* myfree: unallocates memory that has been allocated with mymalloc.
+     void *ptr: pointer to the first byte of a block of memory allocated by 
+                mymalloc.
+     retval: 0 if the memory was successfully freed and 1 otherwise.
+             (NOTE: the system version of free returns no error.)
+*/
+unsigned int myfree(void *ptr) {
+    free(ptr);
+    return 0;
+}
+
+
+/* mymalloc_batch: allocates n blocks of size bytes into out[0] to out[n-1].
+     retval: the number of blocks allocated; the rest of out is set to NULL.
+*/
+size_t mymalloc_batch(size_t size, size_t n, void **out) {
+    size_t i, done = 0;
+    while (done < n && (out[done] = malloc(size)) != NULL) {
+        done++;
+    }
+    for (i = done; i < n; i++) {
+        out[i] = NULL;
+    }
+    return done;
+}
+
+/* myfree_batch: unallocates the n blocks in ptrs.
+     retval: the number of blocks that could not be freed, always 0 here.
+*/
+unsigned int myfree_batch(void **ptrs, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        free(ptrs[i]);
+    }
+    return 0;
+}
+
+/* myfree_sized: unallocates a block allocated with size bytes.
+     retval: 0, the system version of free returns no error.
+*/
+unsigned int myfree_sized(void *ptr, size_t size) {
+    free(ptr);
+    return 0;
+}
+
+/* mymalloc_usable_size: the number of bytes the block at ptr can hold.
+*/
+size_t mymalloc_usable_size(void *ptr) {
+    return malloc_usable_size(ptr);
+}
+
+/* mymalloc_stats: fills out with the allocator's counters. The system
+                   allocator does not expose them, so they are all zero.
+*/
+void mymalloc_stats(stats_t *out) {
+    memset(out, 0, sizeof(stats_t));
+}
+
+/* mymalloc_heapwalk: calls visit for every block of the heap. The system
+                      allocator does not let us walk its heap, so it visits
+                      nothing.
+*/
+void mymalloc_heapwalk(void (*visit)(void *ptr, size_t size, int state, void *arg), void *arg) {
+}
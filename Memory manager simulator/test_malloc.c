@@ -1,282 +1,922 @@
-/* This file contains example invocations of mymalloc and myfree.
-*/
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <sys/time.h>
-#include <pthread.h>
-#include "memory.h"
-
-#define MAX_THREADS 10
-#define MAX_OPS 25000
-#define MAX_LOC MAX_OPS/2
-
-/* Credit: 
- * http://stackoverflow.com/questions/1644868/c-define-macro-for-debug-printing 
- */
-int debug = 0;
-#define debug_print(fmt, ...) \
-	do { if (debug) { fprintf(stdout, fmt, __VA_ARGS__); fflush(stdout); } } while (0)
-
-#define error_print(fmt, ...) \
-	do { fprintf(stderr, fmt, __VA_ARGS__); fflush(stderr); } while (0)
-
-// Prototypes
-   // Returns 0 on success and >0 on error.
-
-// Global variables
-
-// Determines whether test touches memory returned by each mymalloc() call
-int touch_memory = 0;
-
-// Keeping track of heap location and size
-char *start_heap;
-char *max_heap = 0;
-
-void update_heap()
-{
-	if (max_heap < (char*)sbrk(0)) {
-		max_heap = (char*)sbrk(0);
-	}
-}
-
-/* The arrays that hold the trace information are statically allocated because
- * using the libc malloc would interfere using mymalloc.
- */
-struct trace_op {
-	enum {MALLOC, FREE} type;
-	int index; // for myfree() to use later 
-	int size;
-};
-
-struct trace {
-	int num_locations; // do we need this?
-	int num_ops;
-	struct trace_op ops[MAX_OPS];
-	char *blocks[MAX_LOC];
-	int sizes[MAX_LOC];
-};
-
-struct trace ttrace[MAX_THREADS];
-
-// Helper functions for trace replay
-
-#define POISON 0xFF
-
-// Fill a newly allocated block with "poisoning" value
-void touch_after_malloc(long id, int index, char *ptr, int size)
-{
-	if (!touch_memory) {
-		return;
-	}
-	debug_print("[%li]: malloc block %d addr %p size %d touching memory...\n",
-	            id, index, ptr, size);
-	char *p;
-	for (p = ptr; p < ptr + size; p++) {
-		*p = POISON;
-	}
-	debug_print("[%li]: malloc block %d addr %p size %d touching complete\n",
-	            id, index, ptr, size);
-}
-
-// Check that a block to be freed still has its initial contents
-void touch_before_free(long id, int index, char *ptr, int size)
-{
-	if (!touch_memory) {
-		return;
-	}
-	debug_print("[%li]: free block %d addr %p size %d touching memory...\n",
-	            id, index, ptr, size);
-	char *p;
-	for (p = ptr; p < ptr + size; p++) {
-		if (*p != POISON) {
-			error_print("[%li]: free block %d addr %p size %d memory corrupted\n",
-			            id, index, ptr, size);
-		}
-	}
-	debug_print("[%li]: free block %d addr %p size %d touching complete\n",
-	            id, index, ptr, size);
-}
-
-// Each thread executes the operations from its own array
-void *dowork(void *threadid)
-{
-	long id = (long)threadid;
-	int i;
-	char *ptr;
-	struct trace tr = ttrace[id];
-	int ops = tr.num_ops;
-
-	for (i = 0; i < ops; i++) {
-		switch (tr.ops[i].type) {
-		case MALLOC:
-			ptr = mymalloc(tr.ops[i].size);
-			debug_print("[%li]: malloc block %d addr %p size %d\n",
-			            id, tr.ops[i].index, ptr, tr.ops[i].size);
-			update_heap();
-			if (!ptr) {
-				error_print("[%li]: error on allocation %i size %d\n",
-				            id, i, tr.ops[i].size);
-				break;
-			}
-
-			// Check for "heap overflow"
-			if ((ptr < start_heap) || (ptr + tr.ops[i].size >= max_heap)) {
-				error_print("[%li]: malloc block %d addr %p size %d heap overflow\n",
-				            id, tr.ops[i].index, ptr, tr.ops[i].size);
-				break;
-			}
-
-			// Check for non-aligned allocation
-			if ((size_t)ptr % 8 != 0) {
-				error_print("[%li]: malloc block %d addr %p size %d non-aligned\n",
-				            id, tr.ops[i].index, ptr, tr.ops[i].size);
-			}
-
-			tr.blocks[tr.ops[i].index] = ptr;
-			touch_after_malloc(id, tr.ops[i].index, ptr, tr.ops[i].size);
-			break;
-
-		case FREE:
-			debug_print("[%li]: free block %d\n", id, tr.ops[i].index);
-			ptr = tr.blocks[tr.ops[i].index];
-			if (ptr) {
-				touch_before_free(id, tr.ops[i].index, ptr, tr.ops[i].size);
-			}
-			if (myfree(ptr)) {
-				error_print("[%li]: error on free block %d\n", id, i);
-			}
-			break;
-
-		default:
-			fprintf(stderr, "Error: bad instruction\n");
-			exit(1);
-		}
-	}
-
-	pthread_exit(NULL);
-}
-
-// Read the data from the open file fp and populate the global variable ttrace
-int load_trace(FILE *fp)
-{
-	int i, thread, index, size, ci;
-	char type[10];
-	int max_thread = 0;
-
-	for (i = 0; i < MAX_THREADS; i++) {
-		ttrace[i].num_ops = 0;
-	}
-
-	while (fscanf(fp, "%s", type) !=EOF) {
-		switch (type[0]) {
-		case 'm':
-			fscanf(fp, "%u %u %u", &thread, &index, &size);
-			ci = ttrace[thread].num_ops;
-			ttrace[thread].ops[ci].type = MALLOC;
-			ttrace[thread].ops[ci].index = index;
-			ttrace[thread].ops[ci].size = size;
-			ttrace[thread].num_ops++;
-			break;
-		case 'f':
-			fscanf(fp, "%u %u", &thread, &index);
-			ci = ttrace[thread].num_ops;
-			ttrace[thread].ops[ci].type = FREE;
-			ttrace[thread].ops[ci].index = index;
-			ttrace[thread].num_ops++;
-			break;
-		default:
-			fprintf(stderr, "Bad type (%c) in trace file\n", type[0]);
-			exit(1);
-		}
-		max_thread = thread > max_thread ? thread : max_thread;
-	}
-
-	fclose(fp);
-	return max_thread + 1;
-}
-
-void usage(char *argv[])
-{
-	printf("Usage: %s -f <trace file> [-d -t]\n", argv[0]);
-	printf("\t-d : turn on debugging output\n");
-	printf("\t-t : touch allocated memory\n");
-	exit(1);
-}
-
-// Example main function that invokes mymalloc and myfree
-int main(int argc, char *argv[])
-{
-	// Parse arguments and open trace file
-	FILE *fp;
-	char option;
-	int err;
-
-	while ((option = getopt(argc, argv, "f:dt")) != -1)	{
-		switch (option) {
-		case 'f':
-			if ((fp = fopen(optarg, "r")) == NULL) {
-				perror("Trace file open:");
-			}
-			break;
-		case 'd':
-			debug = 1;
-			break;
-		case 't':
-			touch_memory = 1;
-			break;
-		default:
-			usage(argv);
-		}
-	}
-	if (fp == NULL)
-	{
-		usage(argv);
-	}
-
-	// Load the trace
-	int num_threads = load_trace(fp);
-
-	// Remember heap starting position
-	start_heap = sbrk(0);
-
-	// Call heap initialization function 
-	err = mymalloc_init();
-	if (err) {
-		fprintf(stderr, "Error: mymalloc_init failed");
-		return 1;
-	}
-	 
-	// Start needed number of threads to replay the trace; measure time
-	pthread_t threads[MAX_THREADS];
-	long tid;
-	struct timeval start, end;
-
-	gettimeofday(&start, NULL);
-	for (tid = 0; tid < num_threads; tid++) {
-		err = pthread_create(&threads[tid], NULL, dowork, (void *)tid);
-		if (err) {
-			fprintf(stderr, "Error: pthread_create failed on thread %li.\n", tid);
-			return 1;
-		}
-	}
-
-	// Wait for all the threads to finish
-	for (tid = 0; tid < num_threads; tid++) {
-		err = pthread_join(threads[tid], NULL);
-		if (err) {
-			fprintf(stderr, "Error: pthread_join failed on thread %li.\n", tid);
-		}
-	}
-	gettimeofday(&end, NULL);
-
-	// Output execution time and max heap size
-	double diff = 1000000 *(end.tv_sec - start.tv_sec) 
-		+ (end.tv_usec - start.tv_usec);
-	fprintf(stdout, "Time: %f\n", diff);
-	fprintf(stdout, "Max heap extent: %ld\n", max_heap - start_heap);
-
-	return 0;
-}
-
+/* This file contains example invocations of mymalloc and myfree.
+*/
+
+#define _GNU_SOURCE // for pthread_setaffinity_np()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "memory.h"
+#include "trace.h"
+
+/* Credit: 
+ * http://stackoverflow.com/questions/1644868/c-define-macro-for-debug-printing 
+ */
+int debug = 0;
+#define debug_print(fmt, ...) \
+	do { if (debug) { fprintf(stdout, fmt, __VA_ARGS__); fflush(stdout); } } while (0)
+
+#define error_print(fmt, ...) \
+	do { fprintf(stderr, fmt, __VA_ARGS__); fflush(stderr); } while (0)
+
+// Prototypes
+   // Returns 0 on success and >0 on error.
+
+// Global variables
+
+// Determines whether test touches memory returned by each mymalloc() call
+int touch_memory = 0;
+
+// Determines whether the allocator's counters are printed at the end
+int print_stats = 0;
+
+// Format of the latency report, LAT_OFF unless -l is given
+enum {LAT_OFF, LAT_TEXT, LAT_CSV, LAT_JSON} latency = LAT_OFF;
+
+// Whether the current replay is timed, which the warmup replays are not
+int recording = 0;
+
+// Whether the current replay is the last one, whose blocks are left for the heap report
+int final_run = 1;
+
+// The threads start each replay together and stop the clock together
+pthread_barrier_t start_barrier;
+pthread_barrier_t end_barrier;
+
+// CPUs the process may run on; replay thread i is pinned to cpus[i % num_cpus]
+int cpus[CPU_SETSIZE];
+int num_cpus = 0;
+
+// Keeping track of the main arena's heap, the one sbrk() grows; the other
+// arenas map segments of their own and are not tracked
+char *start_heap;
+char *max_heap = 0;
+
+void update_heap()
+{
+	if (max_heap < (char*)sbrk(0)) {
+		max_heap = (char*)sbrk(0);
+	}
+}
+
+// Resident set size in bytes, read from /proc without going through stdio
+// so that reading it does not allocate
+long current_rss()
+{
+	char buf[64];
+	long pages = 0, resident = 0;
+	int fd = open("/proc/self/statm", O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	int n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return -1;
+	}
+	buf[n] = '\0';
+	if (sscanf(buf, "%ld %ld", &pages, &resident) != 2) {
+		return -1;
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Peak resident set size in bytes over the life of the process
+long peak_rss()
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		return -1;
+	}
+	return usage.ru_maxrss * 1024;
+}
+
+#define HIST_BINS 24 // free block sizes are binned by power of two, the last bin takes everything bigger
+
+// What mymalloc_heapwalk() found in the heap
+struct heap_report {
+	long blocks[3]; // indexed by HEAP_FREE, HEAP_USED and HEAP_CACHED
+	long bytes[3];
+	long histogram[HIST_BINS]; // free blocks of at least 1 << i and less than 2 << i bytes
+	long largest; // largest free block
+};
+
+void walk_block(void *ptr, size_t size, int state, void *arg)
+{
+	struct heap_report *r = arg;
+	int bin = 0;
+	r->blocks[state]++;
+	r->bytes[state] += size;
+	if (state != HEAP_FREE) {
+		return;
+	}
+	while (bin < HIST_BINS - 1 && (size >> (bin + 1)) != 0) {
+		bin++;
+	}
+	r->histogram[bin]++;
+	if ((long)size > r->largest) {
+		r->largest = size;
+	}
+}
+
+// Print how the heap is used and how fragmented its free space is; waste is
+// the usable bytes beyond what was asked for in the blocks still live
+void dump_heap(long waste)
+{
+	struct heap_report r = {{0}};
+	int i;
+	mymalloc_heapwalk(walk_block, &r);
+	fprintf(stdout, "Heap blocks: used %ld cached %ld free %ld\n",
+	        r.blocks[HEAP_USED], r.blocks[HEAP_CACHED], r.blocks[HEAP_FREE]);
+	fprintf(stdout, "Heap bytes: used %ld cached %ld free %ld\n",
+	        r.bytes[HEAP_USED], r.bytes[HEAP_CACHED], r.bytes[HEAP_FREE]);
+	// every heap block starts with the head word of a node_t
+	fprintf(stdout, "Header bytes: %ld\n",
+	        (r.blocks[HEAP_USED] + r.blocks[HEAP_CACHED] + r.blocks[HEAP_FREE]) * (long)sizeof(size_t));
+	fprintf(stdout, "Internal waste: %ld\n", waste);
+	fprintf(stdout, "Largest free block: %ld\n", r.largest);
+	fprintf(stdout, "External fragmentation: %.3f\n",
+	        r.bytes[HEAP_FREE] ? 1.0 - (double)r.largest / r.bytes[HEAP_FREE] : 0.0);
+	for (i = 0; i < HIST_BINS; i++) {
+		if (r.histogram[i]) {
+			fprintf(stdout, "Free blocks of %ld%s bytes: %ld\n",
+			        1L << i, i == HIST_BINS - 1 ? " or more" : "", r.histogram[i]);
+		}
+	}
+}
+
+// Print what mymalloc_stats() counted, all zeros for the system allocator
+void dump_stats()
+{
+	stats_t st;
+	mymalloc_stats(&st);
+	fprintf(stdout, "Bytes requested: %zu\n", st.requested);
+	fprintf(stdout, "Bytes reserved: %zu\n", st.reserved);
+	fprintf(stdout, "Mallocs: %zu\n", st.mallocs);
+	fprintf(stdout, "Frees: %zu\n", st.frees);
+	fprintf(stdout, "sbrk calls: %zu\n", st.sbrks);
+	fprintf(stdout, "mmap calls: %zu\n", st.mmaps);
+	fprintf(stdout, "Free blocks: %zu\n", st.free_blocks);
+	fprintf(stdout, "Searches: %zu\n", st.searches);
+	fprintf(stdout, "Search depth: avg %.2f max %zu\n",
+	        st.searches ? (double)st.steps / st.searches : 0.0, st.max_steps);
+	fprintf(stdout, "Coalesce: none %zu left %zu right %zu both %zu\n",
+	        st.coalesce[0], st.coalesce[1], st.coalesce[2], st.coalesce[3]);
+	fprintf(stdout, "Lock waits: %zu\n", st.waits);
+	fprintf(stdout, "Lock wait time: %zu ns\n", st.wait_ns);
+}
+
+const char *op_names[OP_TYPES] = {"malloc", "free", "malloc_batch", "free_batch",
+                                  "memalign", "realloc", "calloc", "free_sized", "put", "get"};
+
+/* Latencies are kept in HDR style histograms: values below 1 << SUB_BITS get a
+ * bucket each, larger ones are bucketed by their highest set bit and the
+ * SUB_BITS bits below it, so every bucket is within about 3% of its values
+ * whatever their magnitude, and recording one is a handful of instructions.
+ */
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+struct histogram {
+	long counts[BUCKETS];
+	long total;
+	uint64_t max;
+};
+
+/* What each replay thread keeps. The trace says how many threads there are,
+ * so this is mapped once it is loaded; the libc malloc would interfere with
+ * mymalloc. Threads start on cache lines of their own.
+ */
+struct replay {
+	struct histogram hist[OP_TYPES]; // latencies of each kind of operation
+	uint64_t ticks; // spent replaying, over all the timed replays
+	long live_waste; // usable bytes beyond what was asked for, in blocks still live at the end
+	char **blocks; // slot i holds the block the trace calls i, NULL once freed
+	size_t *sizes;
+	pthread_t thread;
+} __attribute__((aligned(64)));
+
+/* Blocks on their way from one replay thread to another. A channel holds
+ * every block the trace ever puts on it, so the sender never waits, and
+ * the two counters are each written by one end only.
+ */
+struct channel {
+	char **blocks;
+	size_t *sizes;
+	uint64_t put __attribute__((aligned(64))); // blocks the sender has stored, published with release
+	uint64_t got __attribute__((aligned(64))); // blocks the receiver has taken
+} __attribute__((aligned(64)));
+
+// The trace, mapped, one replay per thread in it and one channel per channel
+struct trace trace;
+struct replay *replays;
+struct channel *channels;
+
+// Zeroed memory that is only backed once it is touched
+void *map_zeroed(size_t bytes)
+{
+	void *p = mmap(NULL, bytes ? bytes : 1, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("Replay mmap");
+		exit(1);
+	}
+	return p;
+}
+
+// Clock ticks per nanosecond, measured at startup
+double ticks_per_ns = 1.0;
+
+// Cycle counter on x86, which costs a few nanoseconds to read, nanoseconds elsewhere
+static inline uint64_t ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Measure how fast ticks() runs against the monotonic clock
+void calibrate_ticks()
+{
+	struct timespec a, b, pause = {0, 20000000};
+	uint64_t t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	t0 = ticks();
+	nanosleep(&pause, NULL);
+	t1 = ticks();
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	ticks_per_ns = (double)(t1 - t0) /
+		((b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec));
+}
+
+int bucket_of(uint64_t v)
+{
+	int msb;
+	if (v < SUB_COUNT) {
+		return v;
+	}
+	msb = 63 - __builtin_clzll(v);
+	return (msb - SUB_BITS + 1) * SUB_COUNT + ((v >> (msb - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+// Largest value that falls into bucket b
+uint64_t bucket_top(int b)
+{
+	int shift;
+	if (b < SUB_COUNT) {
+		return b;
+	}
+	shift = b / SUB_COUNT - 1;
+	return ((uint64_t)(SUB_COUNT + b % SUB_COUNT + 1) << shift) - 1;
+}
+
+// Start timing an operation, returns 0 when this replay is not timed
+static inline uint64_t lat_start()
+{
+	return recording ? ticks() : 0;
+}
+
+// Record the latency of an operation started at t0
+static inline void lat_stop(long id, int type, uint64_t t0)
+{
+	if (recording) {
+		uint64_t v = ticks() - t0;
+		struct histogram *h = &replays[id].hist[type];
+		h->counts[bucket_of(v)]++;
+		h->total++;
+		if (v > h->max) {
+			h->max = v;
+		}
+	}
+}
+
+void merge_histogram(struct histogram *into, struct histogram *h)
+{
+	int b;
+	for (b = 0; b < BUCKETS; b++) {
+		into->counts[b] += h->counts[b];
+	}
+	into->total += h->total;
+	into->max = h->max > into->max ? h->max : into->max;
+}
+
+// Latency in nanoseconds below which a fraction p of the operations fall
+double percentile(struct histogram *h, double p)
+{
+	long seen = 0, target = (long)(p * h->total + 0.999999);
+	int b;
+	for (b = 0; b < BUCKETS; b++) {
+		seen += h->counts[b];
+		if (seen >= target && seen > 0) {
+			uint64_t top = bucket_top(b);
+			return (top < h->max ? top : h->max) / ticks_per_ns;
+		}
+	}
+	return h->max / ticks_per_ns;
+}
+
+// Print one row of the latency report; thread is -1 for all threads together
+void print_latency_row(int thread, int type, struct histogram *h, double seconds, int *first)
+{
+	char name[16];
+	double rate = seconds > 0 ? h->total / seconds : 0;
+	if (thread < 0) {
+		strcpy(name, "all");
+	} else {
+		snprintf(name, sizeof(name), "%d", thread);
+	}
+	switch (latency) {
+	case LAT_CSV:
+		fprintf(stdout, "%s,%s,%ld,%.1f,%.1f,%.1f,%.1f,%.0f\n", name, op_names[type], h->total,
+		        percentile(h, 0.5), percentile(h, 0.99), percentile(h, 0.999),
+		        h->max / ticks_per_ns, rate);
+		break;
+	case LAT_JSON:
+		fprintf(stdout, "%s\n    {\"thread\": \"%s\", \"op\": \"%s\", \"count\": %ld, "
+		        "\"p50_ns\": %.1f, \"p99_ns\": %.1f, \"p99_9_ns\": %.1f, "
+		        "\"max_ns\": %.1f, \"ops_per_sec\": %.0f}",
+		        *first ? "" : ",", name, op_names[type], h->total,
+		        percentile(h, 0.5), percentile(h, 0.99), percentile(h, 0.999),
+		        h->max / ticks_per_ns, rate);
+		break;
+	default:
+		fprintf(stdout, "%-6s %-12s %10ld %10.1f %10.1f %10.1f %12.1f %12.0f\n", name,
+		        op_names[type], h->total, percentile(h, 0.5), percentile(h, 0.99),
+		        percentile(h, 0.999), h->max / ticks_per_ns, rate);
+	}
+	*first = 0;
+}
+
+/* Print p50, p99, p99.9 and max latency and the throughput of every kind of
+ * operation, for each thread and for all of them together. A thread's rate is
+ * over the time it spent replaying, the combined rate over the wall time of
+ * the timed replays.
+ */
+void dump_latency(int num_threads, int runs, double wall_us)
+{
+	struct histogram all;
+	int t, type, first = 1;
+	switch (latency) {
+	case LAT_CSV:
+		fprintf(stdout, "thread,op,count,p50_ns,p99_ns,p99_9_ns,max_ns,ops_per_sec\n");
+		break;
+	case LAT_JSON:
+		fprintf(stdout, "{\n  \"runs\": %d,\n  \"time_us\": %.1f,\n  \"latency\": [", runs, wall_us / runs);
+		break;
+	default:
+		fprintf(stdout, "%-6s %-12s %10s %10s %10s %10s %12s %12s\n", "thread", "op", "count",
+		        "p50 ns", "p99 ns", "p99.9 ns", "max ns", "ops/s");
+	}
+	for (type = 0; type < OP_TYPES; type++) {
+		memset(&all, 0, sizeof(all));
+		for (t = 0; t < num_threads; t++) {
+			if (replays[t].hist[type].total == 0) {
+				continue;
+			}
+			print_latency_row(t, type, &replays[t].hist[type],
+			                  replays[t].ticks / ticks_per_ns / 1e9, &first);
+			merge_histogram(&all, &replays[t].hist[type]);
+		}
+		if (all.total > 0) {
+			print_latency_row(-1, type, &all, wall_us / 1e6, &first);
+		}
+	}
+	if (latency == LAT_JSON) {
+		fprintf(stdout, "\n  ]\n}\n");
+	}
+}
+
+// Pin the calling replay thread to one of the CPUs we may use
+void pin_thread(long id)
+{
+	cpu_set_t set;
+	if (num_cpus == 0) {
+		return;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpus[id % num_cpus], &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Helper functions for trace replay
+
+#define POISON 0xFF
+
+// Fill a newly allocated block with "poisoning" value
+void touch_after_malloc(long id, int index, char *ptr, size_t size)
+{
+	if (!touch_memory) {
+		return;
+	}
+	debug_print("[%li]: malloc block %d addr %p size %zu touching memory...\n",
+	            id, index, ptr, size);
+	char *p;
+	for (p = ptr; p < ptr + size; p++) {
+		*p = POISON;
+	}
+	debug_print("[%li]: malloc block %d addr %p size %zu touching complete\n",
+	            id, index, ptr, size);
+}
+
+// Check that a block to be freed still has its initial contents
+void touch_before_free(long id, int index, char *ptr, size_t size)
+{
+	if (!touch_memory) {
+		return;
+	}
+	debug_print("[%li]: free block %d addr %p size %zu touching memory...\n",
+	            id, index, ptr, size);
+	unsigned char *p;
+	for (p = (unsigned char *)ptr; p < (unsigned char *)ptr + size; p++) {
+		if (*p != POISON) {
+			error_print("[%li]: free block %d addr %p size %zu memory corrupted\n",
+			            id, index, ptr, size);
+			return;
+		}
+	}
+	debug_print("[%li]: free block %d addr %p size %zu touching complete\n",
+	            id, index, ptr, size);
+}
+
+// Check a newly allocated block and fill it; returns 1 if it must not be used
+int check_malloc(long id, int index, char *ptr, size_t size)
+{
+	// Check for "heap overflow" in the main arena's heap. Blocks above it
+	// come from arenas that map their memory and are not checked.
+	if ((ptr < start_heap) ||
+	    (ptr < max_heap && ptr + size >= max_heap)) {
+		error_print("[%li]: malloc block %d addr %p size %zu heap overflow\n",
+		            id, index, ptr, size);
+		return 1;
+	}
+
+	// Check for non-aligned allocation; every block must suit max_align_t,
+	// which is 16 bytes on x86-64
+	if ((size_t)ptr % 16 != 0) {
+		error_print("[%li]: malloc block %d addr %p size %zu non-aligned\n",
+		            id, index, ptr, size);
+	}
+
+	// Check that the block holds at least what was asked for
+	if (mymalloc_usable_size(ptr) < (size_t)size) {
+		error_print("[%li]: malloc block %d addr %p size %zu usable size %zu\n",
+		            id, index, ptr, size, mymalloc_usable_size(ptr));
+	}
+
+	touch_after_malloc(id, index, ptr, size);
+	return 0;
+}
+
+// Check that a block from mycalloc() is all zero
+void touch_after_calloc(long id, int index, char *ptr, size_t size)
+{
+	if (!touch_memory) {
+		return;
+	}
+	char *p;
+	for (p = ptr; p < ptr + size; p++) {
+		if (*p != 0) {
+			error_print("[%li]: calloc block %d addr %p size %zu not zeroed\n",
+			            id, index, ptr, size);
+			return;
+		}
+	}
+}
+
+// Check that a block moved by myrealloc() kept the first size bytes
+void touch_after_realloc(long id, int index, char *ptr, size_t size)
+{
+	if (!touch_memory) {
+		return;
+	}
+	unsigned char *p;
+	for (p = (unsigned char *)ptr; p < (unsigned char *)ptr + size; p++) {
+		if (*p != POISON) {
+			error_print("[%li]: realloc block %d addr %p size %zu contents lost\n",
+			            id, index, ptr, size);
+			return;
+		}
+	}
+}
+
+// Each thread streams the operations of its own part of the mapped trace
+void *dowork(void *threadid)
+{
+	long id = (long)threadid;
+	long i, ops = trace.threads[id].num_ops;
+	int j, n;
+	size_t bytes;
+	char *ptr;
+	struct trace_op *op = trace_ops(&trace, id);
+	char **blocks = replays[id].blocks;
+	size_t *sizes = replays[id].sizes;
+	struct channel *ch;
+	uint64_t t0, begin;
+
+	pin_thread(id);
+	pthread_barrier_wait(&start_barrier);
+	begin = lat_start();
+
+	for (i = 0; i < ops; i++, op++) {
+		switch (op->type) {
+		case MALLOC:
+			t0 = lat_start();
+			ptr = mymalloc(op->size);
+			lat_stop(id, MALLOC, t0);
+			debug_print("[%li]: malloc block %d addr %p size %d\n",
+			            id, op->index, ptr, op->size);
+			update_heap();
+			if (!ptr) {
+				error_print("[%li]: error on allocation %li size %d\n",
+				            id, i, op->size);
+				break;
+			}
+
+			if (check_malloc(id, op->index, ptr, op->size)) {
+				break;
+			}
+
+			blocks[op->index] = ptr;
+			sizes[op->index] = op->size;
+			break;
+
+		case MEMALIGN:
+			t0 = lat_start();
+			ptr = mymemalign(op->align, op->size);
+			lat_stop(id, MEMALIGN, t0);
+			debug_print("[%li]: memalign block %d addr %p size %d align %d\n",
+			            id, op->index, ptr, op->size, op->align);
+			update_heap();
+			if (!ptr) {
+				error_print("[%li]: error on allocation %li size %d\n",
+				            id, i, op->size);
+				break;
+			}
+
+			if ((size_t)ptr % op->align != 0) {
+				error_print("[%li]: memalign block %d addr %p align %d misaligned\n",
+				            id, op->index, ptr, op->align);
+			}
+
+			if (check_malloc(id, op->index, ptr, op->size)) {
+				break;
+			}
+
+			blocks[op->index] = ptr;
+			sizes[op->index] = op->size;
+			break;
+
+		case MALLOC_BATCH:
+			t0 = lat_start();
+			n = mymalloc_batch(op->size, op->count,
+			                   (void **)&blocks[op->index]);
+			lat_stop(id, MALLOC_BATCH, t0);
+			debug_print("[%li]: malloc batch %d count %d size %d got %d\n",
+			            id, op->index, op->count, op->size, n);
+			update_heap();
+			if (n < op->count) {
+				error_print("[%li]: error on allocation %li batch of %d size %d\n",
+				            id, i, op->count, op->size);
+			}
+			for (j = op->index; j < op->index + n; j++) {
+				if (check_malloc(id, j, blocks[j], op->size)) {
+					blocks[j] = NULL;
+				}
+				sizes[j] = op->size;
+			}
+			break;
+
+		case CALLOC:
+			bytes = (size_t)op->count * op->size; // mycalloc() checks the product itself
+			t0 = lat_start();
+			ptr = mycalloc(op->count, op->size);
+			lat_stop(id, CALLOC, t0);
+			debug_print("[%li]: calloc block %d addr %p size %zu\n",
+			            id, op->index, ptr, bytes);
+			update_heap();
+			if (!ptr) {
+				error_print("[%li]: error on allocation %li size %zu\n",
+				            id, i, bytes);
+				break;
+			}
+			touch_after_calloc(id, op->index, ptr, bytes);
+
+			if (check_malloc(id, op->index, ptr, bytes)) {
+				break;
+			}
+
+			blocks[op->index] = ptr;
+			sizes[op->index] = bytes;
+			break;
+
+		case REALLOC:
+			j = op->index;
+			t0 = lat_start();
+			ptr = myrealloc(blocks[j], op->size);
+			lat_stop(id, REALLOC, t0);
+			debug_print("[%li]: realloc block %d addr %p size %d\n",
+			            id, j, ptr, op->size);
+			update_heap();
+			if (!ptr) {
+				error_print("[%li]: error on reallocation %li size %d\n",
+				            id, i, op->size);
+				break;
+			}
+			touch_after_realloc(id, j, ptr,
+			                    sizes[j] < op->size ? sizes[j] : op->size);
+
+			if (check_malloc(id, j, ptr, op->size)) {
+				break;
+			}
+
+			blocks[j] = ptr;
+			sizes[j] = op->size;
+			break;
+
+		case FREE:
+			debug_print("[%li]: free block %d\n", id, op->index);
+			ptr = blocks[op->index];
+			if (ptr) {
+				touch_before_free(id, op->index, ptr, sizes[op->index]);
+			}
+			t0 = lat_start();
+			n = myfree(ptr);
+			lat_stop(id, FREE, t0);
+			if (n) {
+				error_print("[%li]: error on free block %li\n", id, i);
+			}
+			blocks[op->index] = NULL;
+			break;
+
+		case FREE_SIZED:
+			j = op->index;
+			debug_print("[%li]: free block %d size %zu\n", id, j, sizes[j]);
+			if (blocks[j]) {
+				touch_before_free(id, j, blocks[j], sizes[j]);
+			}
+			t0 = lat_start();
+			n = myfree_sized(blocks[j], sizes[j]);
+			lat_stop(id, FREE_SIZED, t0);
+			if (n) {
+				error_print("[%li]: error on free block %li\n", id, i);
+			}
+			blocks[j] = NULL;
+			break;
+
+		case PUT:
+			ch = &channels[op->channel];
+			debug_print("[%li]: put block %d on channel %d\n", id, op->index, op->channel);
+			ch->blocks[ch->put] = blocks[op->index];
+			ch->sizes[ch->put] = sizes[op->index];
+			__atomic_store_n(&ch->put, ch->put + 1, __ATOMIC_RELEASE);
+			blocks[op->index] = NULL;
+			break;
+
+		case GET:
+			ch = &channels[op->channel];
+			while (__atomic_load_n(&ch->put, __ATOMIC_ACQUIRE) == ch->got) {
+				sched_yield();
+			}
+			blocks[op->index] = ch->blocks[ch->got];
+			sizes[op->index] = ch->sizes[ch->got];
+			ch->got++;
+			debug_print("[%li]: get block %d from channel %d\n", id, op->index, op->channel);
+			break;
+
+		case FREE_BATCH:
+			// myfree_batch() reorders the slots it is given, they are all dead afterwards
+			debug_print("[%li]: free batch %d count %d\n",
+			            id, op->index, op->count);
+			for (j = op->index; j < op->index + op->count; j++) {
+				if (blocks[j]) {
+					touch_before_free(id, j, blocks[j], sizes[j]);
+				}
+			}
+			t0 = lat_start();
+			n = myfree_batch((void **)&blocks[op->index], op->count);
+			lat_stop(id, FREE_BATCH, t0);
+			if (n) {
+				error_print("[%li]: error on free batch %li\n", id, i);
+			}
+			for (j = op->index; j < op->index + op->count; j++) {
+				blocks[j] = NULL;
+			}
+			break;
+
+		default:
+			fprintf(stderr, "Error: bad instruction\n");
+			exit(1);
+		}
+	}
+
+	if (recording) {
+		replays[id].ticks += ticks() - begin;
+	}
+	pthread_barrier_wait(&end_barrier);
+
+	// Rounding and unsplit remainders of the blocks the trace never frees,
+	// which are freed after every replay but the last
+	for (j = 0; j < (int)trace.threads[id].num_locations; j++) {
+		if (!blocks[j]) {
+			continue;
+		}
+		if (final_run) {
+			replays[id].live_waste += mymalloc_usable_size(blocks[j]) - sizes[j];
+		} else {
+			myfree(blocks[j]);
+			blocks[j] = NULL;
+		}
+	}
+
+	pthread_exit(NULL);
+}
+
+void usage(char *argv[])
+{
+	printf("Usage: %s -f <trace file> [-d -t -s -p <policy> -l <format> -r <runs> -w <runs>]\n", argv[0]);
+	printf("\t-d : turn on debugging output\n");
+	printf("\t-t : touch allocated memory\n");
+	printf("\t-s : print the allocator's statistics\n");
+	printf("\t-p : placement policy: first, next, best or address\n");
+	printf("\t-l : time every operation and report latencies as text, csv or json\n");
+	printf("\t-r : number of timed replays of the trace, 1 by default\n");
+	printf("\t-w : number of untimed warmup replays before them, 0 by default\n");
+	exit(1);
+}
+
+// Example main function that invokes mymalloc and myfree
+int main(int argc, char *argv[])
+{
+	// Parse arguments and open trace file
+	char *path = NULL;
+	int option;
+	int err;
+	int runs = 1, warmup = 0, run;
+
+	while ((option = getopt(argc, argv, "f:dtsp:l:r:w:")) != -1)	{
+		switch (option) {
+		case 'f':
+			path = optarg;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 't':
+			touch_memory = 1;
+			break;
+		case 's':
+			print_stats = 1;
+			break;
+		case 'p':
+			// read by mymalloc_init(), so it has to be set before that is called
+			setenv("MYMALLOC_POLICY", optarg, 1);
+			break;
+		case 'l':
+			if (strcmp(optarg, "text") == 0) {
+				latency = LAT_TEXT;
+			} else if (strcmp(optarg, "csv") == 0) {
+				latency = LAT_CSV;
+			} else if (strcmp(optarg, "json") == 0) {
+				latency = LAT_JSON;
+			} else {
+				usage(argv);
+			}
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		default:
+			usage(argv);
+		}
+	}
+	if (path == NULL || runs < 1 || warmup < 0)
+	{
+		usage(argv);
+	}
+
+	// Map the trace and what each of its threads needs to replay it
+	if (trace_open(path, &trace)) {
+		return 1;
+	}
+	int num_threads = trace.num_threads;
+	long tid, waste = 0;
+	replays = map_zeroed(num_threads * sizeof(struct replay));
+	for (tid = 0; tid < num_threads; tid++) {
+		replays[tid].blocks = map_zeroed(trace.threads[tid].num_locations * sizeof(char *));
+		replays[tid].sizes = map_zeroed(trace.threads[tid].num_locations * sizeof(size_t));
+		madvise(trace_ops(&trace, tid), trace.threads[tid].num_ops * sizeof(struct trace_op),
+		        MADV_SEQUENTIAL);
+	}
+	channels = map_zeroed(trace.num_channels * sizeof(struct channel));
+	for (tid = 0; tid < trace.num_channels; tid++) {
+		channels[tid].blocks = map_zeroed(trace.channels[tid].puts * sizeof(char *));
+		channels[tid].sizes = map_zeroed(trace.channels[tid].puts * sizeof(size_t));
+	}
+
+	// Remember heap starting position
+	start_heap = sbrk(0);
+
+	// Call heap initialization function 
+	err = mymalloc_init();
+	if (err) {
+		fprintf(stderr, "Error: mymalloc_init failed");
+		return 1;
+	}
+	 
+	// Replay threads are spread over the CPUs we are allowed to use
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		for (err = 0; err < CPU_SETSIZE; err++) {
+			if (CPU_ISSET(err, &allowed)) {
+				cpus[num_cpus++] = err;
+			}
+		}
+	}
+	if (latency != LAT_OFF) {
+		calibrate_ticks();
+	}
+
+	// Start needed number of threads to replay the trace; measure time
+	// from when they are all ready to when the last one is done
+	struct timeval start, end;
+	double diff = 0;
+
+	pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+	pthread_barrier_init(&end_barrier, NULL, num_threads + 1);
+
+	for (run = 0; run < warmup + runs; run++) {
+		recording = run >= warmup && latency != LAT_OFF;
+		final_run = run == warmup + runs - 1;
+		for (tid = 0; tid < trace.num_channels; tid++) {
+			channels[tid].put = channels[tid].got = 0;
+		}
+
+		for (tid = 0; tid < num_threads; tid++) {
+			err = pthread_create(&replays[tid].thread, NULL, dowork, (void *)tid);
+			if (err) {
+				fprintf(stderr, "Error: pthread_create failed on thread %li.\n", tid);
+				return 1;
+			}
+		}
+
+		pthread_barrier_wait(&start_barrier);
+		gettimeofday(&start, NULL);
+		pthread_barrier_wait(&end_barrier);
+		gettimeofday(&end, NULL);
+
+		// Wait for all the threads to finish
+		for (tid = 0; tid < num_threads; tid++) {
+			err = pthread_join(replays[tid].thread, NULL);
+			if (err) {
+				fprintf(stderr, "Error: pthread_join failed on thread %li.\n", tid);
+			}
+		}
+
+		if (run >= warmup) {
+			diff += 1000000 *(end.tv_sec - start.tv_sec)
+				+ (end.tv_usec - start.tv_usec);
+		}
+	}
+
+	// Machine readable latencies are printed on their own
+	if (latency == LAT_CSV || latency == LAT_JSON) {
+		dump_latency(num_threads, runs, diff);
+		return 0;
+	}
+
+	// Output execution time, averaged over the timed replays, and max heap size
+	fprintf(stdout, "Time: %f\n", diff / runs);
+	fprintf(stdout, "Max heap extent (arena 0): %ld\n", max_heap - start_heap);
+	fprintf(stdout, "Current RSS: %ld\n", current_rss());
+	fprintf(stdout, "Peak RSS: %ld\n", peak_rss());
+	for (tid = 0; tid < num_threads; tid++) {
+		waste += replays[tid].live_waste;
+	}
+	dump_heap(waste);
+	if (print_stats) {
+		dump_stats();
+	}
+	if (latency == LAT_TEXT) {
+		dump_latency(num_threads, runs, diff);
+	}
+
+	return 0;
+}
+
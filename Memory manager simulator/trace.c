@@ -0,0 +1,432 @@
+/* Reading, converting and mapping traces. Traces live in mappings rather
+ * than on the heap, so loading one leaves the heap the replay measures
+ * untouched, and a trace only costs the pages of it the replay touches.
+ */
+
+#define _GNU_SOURCE // for mremap()
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+#define ROUND_UP(x, a) (((x) + (a) - 1) & ~(uint64_t)((a) - 1))
+
+// Read the next operation of a text trace; returns 1 per op, 0 at the end and -1 on error
+int trace_read_op(FILE *fp, uint32_t *thread, struct trace_op *op)
+{
+	char type[10];
+	int n, want;
+
+	if (fscanf(fp, "%9s", type) == EOF) {
+		return 0;
+	}
+	memset(op, 0, sizeof(*op));
+	switch (type[0]) {
+	case 'm':
+		op->type = MALLOC;
+		n = fscanf(fp, "%u %u %u", thread, &op->index, &op->size);
+		want = 3;
+		break;
+	case 'f':
+		op->type = FREE;
+		n = fscanf(fp, "%u %u", thread, &op->index);
+		want = 2;
+		break;
+	case 'c':
+		op->type = CALLOC;
+		n = fscanf(fp, "%u %u %u %u", thread, &op->index, &op->count, &op->size);
+		want = 4;
+		break;
+	case 'r':
+		op->type = REALLOC;
+		n = fscanf(fp, "%u %u %u", thread, &op->index, &op->size);
+		want = 3;
+		break;
+	case 'a':
+		op->type = MEMALIGN;
+		n = fscanf(fp, "%u %u %u %u", thread, &op->index, &op->size, &op->align);
+		want = 4;
+		break;
+	case 'x':
+		op->type = FREE_SIZED;
+		n = fscanf(fp, "%u %u", thread, &op->index);
+		want = 2;
+		break;
+	case 'M':
+		op->type = MALLOC_BATCH;
+		n = fscanf(fp, "%u %u %u %u", thread, &op->index, &op->count, &op->size);
+		want = 4;
+		break;
+	case 'F':
+		op->type = FREE_BATCH;
+		n = fscanf(fp, "%u %u %u", thread, &op->index, &op->count);
+		want = 3;
+		break;
+	case 'p':
+		op->type = PUT;
+		n = fscanf(fp, "%u %u %u", thread, &op->index, &op->channel);
+		want = 3;
+		break;
+	case 'g':
+		op->type = GET;
+		n = fscanf(fp, "%u %u %u", thread, &op->index, &op->channel);
+		want = 3;
+		break;
+	default:
+		fprintf(stderr, "Bad type (%c) in trace file\n", type[0]);
+		return -1;
+	}
+	if (n != want) {
+		fprintf(stderr, "Truncated (%c) operation in trace file\n", type[0]);
+		return -1;
+	}
+	return 1;
+}
+
+// Write op as a line of a text trace
+void trace_write_op(FILE *fp, uint32_t thread, struct trace_op *op)
+{
+	switch (op->type) {
+	case MALLOC:
+		fprintf(fp, "m %u %u %u\n", thread, op->index, op->size);
+		break;
+	case FREE:
+		fprintf(fp, "f %u %u\n", thread, op->index);
+		break;
+	case CALLOC:
+		fprintf(fp, "c %u %u %u %u\n", thread, op->index, op->count, op->size);
+		break;
+	case REALLOC:
+		fprintf(fp, "r %u %u %u\n", thread, op->index, op->size);
+		break;
+	case MEMALIGN:
+		fprintf(fp, "a %u %u %u %u\n", thread, op->index, op->size, op->align);
+		break;
+	case FREE_SIZED:
+		fprintf(fp, "x %u %u\n", thread, op->index);
+		break;
+	case MALLOC_BATCH:
+		fprintf(fp, "M %u %u %u %u\n", thread, op->index, op->count, op->size);
+		break;
+	case FREE_BATCH:
+		fprintf(fp, "F %u %u %u\n", thread, op->index, op->count);
+		break;
+	case PUT:
+		fprintf(fp, "p %u %u %u\n", thread, op->index, op->channel);
+		break;
+	case GET:
+		fprintf(fp, "g %u %u %u\n", thread, op->index, op->channel);
+		break;
+	}
+}
+
+// Make room for entries 0 to n - 1 of a table of per-thread counters, which
+// starts out unmapped and grows a page at a time
+static void *grow_table(void *table, size_t *bytes, size_t n, size_t size)
+{
+	size_t want = ROUND_UP(n * size, TRACE_ALIGN);
+	void *p;
+	if (want <= *bytes) {
+		return table;
+	}
+	if (*bytes == 0) {
+		p = mmap(NULL, want, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	} else {
+		p = mremap(table, *bytes, want, MREMAP_MAYMOVE);
+	}
+	if (p == MAP_FAILED) {
+		perror("Trace table mmap");
+		return NULL;
+	}
+	*bytes = want;
+	return p;
+}
+
+// Count op towards its thread's stream and, for PUT and GET, its channel
+int trace_tally_op(struct trace_tally *t, uint32_t thread, struct trace_op *op)
+{
+	struct trace_channel *ch;
+	uint64_t end;
+
+	if (thread >= TRACE_MAX_THREADS) {
+		fprintf(stderr, "Thread %u is past the limit of %d\n", thread, TRACE_MAX_THREADS);
+		return -1;
+	}
+	if (thread >= t->num_threads) {
+		t->threads = grow_table(t->threads, &t->threads_bytes, thread + 1, sizeof(*t->threads));
+		if (!t->threads) {
+			return -1;
+		}
+		t->num_threads = thread + 1;
+	}
+	t->threads[thread].num_ops++;
+	end = (uint64_t)op->index + (op->type == MALLOC_BATCH || op->type == FREE_BATCH ? op->count : 1);
+	if (end > t->threads[thread].num_locations) {
+		t->threads[thread].num_locations = end;
+	}
+	if (op->type != PUT && op->type != GET) {
+		return 0;
+	}
+
+	if (op->channel >= TRACE_MAX_CHANNELS) {
+		fprintf(stderr, "Channel %u is past the limit of %d\n", op->channel, TRACE_MAX_CHANNELS);
+		return -1;
+	}
+	if (op->channel >= t->num_channels) {
+		t->channels = grow_table(t->channels, &t->channels_bytes, op->channel + 1, sizeof(*t->channels));
+		if (!t->channels) {
+			return -1;
+		}
+		t->num_channels = op->channel + 1;
+	}
+	ch = &t->channels[op->channel];
+	if (op->type == PUT) {
+		if (ch->sender && ch->sender != thread + 1) {
+			fprintf(stderr, "Channel %u has more than one sender\n", op->channel);
+			return -1;
+		}
+		ch->sender = thread + 1;
+		ch->puts++;
+	} else {
+		if (ch->receiver && ch->receiver != thread + 1) {
+			fprintf(stderr, "Channel %u has more than one receiver\n", op->channel);
+			return -1;
+		}
+		ch->receiver = thread + 1;
+		ch->gets++;
+	}
+	return 0;
+}
+
+/* Place every stream counted in t and map the trace; with fd -1 it lives in
+ * anonymous memory, otherwise fd is sized to fit and mapped shared so the
+ * ops land in the file. The ops still have to be written with
+ * trace_put_op(), in the same order per thread as they were counted.
+ */
+int trace_layout(struct trace_tally *t, int fd, struct trace *tr)
+{
+	struct trace_header *h;
+	uint64_t offset;
+	uint32_t i;
+
+	if (t->num_threads == 0) {
+		fprintf(stderr, "Empty trace file\n");
+		return -1;
+	}
+	for (i = 0; i < t->num_channels; i++) {
+		if (t->channels[i].puts != t->channels[i].gets) {
+			fprintf(stderr, "Channel %u has %lu puts but %lu gets\n", i,
+			        (unsigned long)t->channels[i].puts, (unsigned long)t->channels[i].gets);
+			return -1;
+		}
+	}
+
+	// The tables, then every stream on a page boundary
+	offset = ROUND_UP(sizeof(*h) + t->num_threads * sizeof(*t->threads) +
+	                  t->num_channels * sizeof(*t->channels), TRACE_ALIGN);
+	for (i = 0; i < t->num_threads; i++) {
+		t->threads[i].offset = offset;
+		offset = ROUND_UP(offset + t->threads[i].num_ops * sizeof(struct trace_op), TRACE_ALIGN);
+	}
+
+	tr->length = offset;
+	if (fd < 0) {
+		tr->base = mmap(NULL, tr->length, PROT_READ | PROT_WRITE,
+		                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	} else {
+		if (ftruncate(fd, tr->length)) {
+			perror("Trace file resize");
+			return -1;
+		}
+		tr->base = mmap(NULL, tr->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (tr->base == MAP_FAILED) {
+		perror("Trace mmap");
+		return -1;
+	}
+
+	h = (struct trace_header *)tr->base;
+	memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+	h->version = TRACE_VERSION;
+	h->num_threads = t->num_threads;
+	h->num_channels = t->num_channels;
+	tr->num_threads = t->num_threads;
+	tr->num_channels = t->num_channels;
+	tr->threads = (struct trace_thread *)(h + 1);
+	tr->channels = (struct trace_channel *)(tr->threads + t->num_threads);
+	memcpy(tr->threads, t->threads, t->num_threads * sizeof(*t->threads));
+	if (t->num_channels) {
+		memcpy(tr->channels, t->channels, t->num_channels * sizeof(*t->channels));
+	}
+
+	// From here on the op counts say where each stream's next op goes
+	for (i = 0; i < t->num_threads; i++) {
+		t->threads[i].num_ops = 0;
+	}
+	return 0;
+}
+
+void trace_put_op(struct trace_tally *t, struct trace *tr, uint32_t thread, struct trace_op *op)
+{
+	trace_ops(tr, thread)[t->threads[thread].num_ops++] = *op;
+}
+
+void trace_tally_free(struct trace_tally *t)
+{
+	if (t->threads) {
+		munmap(t->threads, t->threads_bytes);
+	}
+	if (t->channels) {
+		munmap(t->channels, t->channels_bytes);
+	}
+}
+
+/* Convert the text trace fp into the binary layout. The first pass counts
+ * each thread's operations and slots, which places every stream, and the
+ * second writes the ops in place, so only the mapping grows with the trace.
+ */
+int trace_convert(FILE *fp, int fd, struct trace *tr)
+{
+	struct trace_tally t = {0};
+	struct trace_op op;
+	uint32_t thread;
+	int err;
+
+	while ((err = trace_read_op(fp, &thread, &op)) > 0) {
+		if (trace_tally_op(&t, thread, &op)) {
+			err = -1;
+			break;
+		}
+	}
+	if (err < 0 || trace_layout(&t, fd, tr)) {
+		trace_tally_free(&t);
+		return -1;
+	}
+
+	rewind(fp);
+	while (trace_read_op(fp, &thread, &op) > 0) {
+		trace_put_op(&t, tr, thread, &op);
+	}
+
+	trace_tally_free(&t);
+	return 0;
+}
+
+// Map a binary trace, or convert a text one into memory
+int trace_open(const char *path, struct trace *tr)
+{
+	struct trace_header h;
+	struct stat st;
+	struct trace_op *op;
+	uint32_t t;
+	uint64_t end, i, *puts = NULL;
+	size_t puts_bytes = 0;
+	int fd, err;
+	FILE *fp;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror("Trace file open");
+		return -1;
+	}
+	if (read(fd, &h, sizeof(h)) != sizeof(h) ||
+	    memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0) {
+		close(fd);
+		if ((fp = fopen(path, "r")) == NULL) {
+			perror("Trace file open");
+			return -1;
+		}
+		err = trace_convert(fp, -1, tr);
+		fclose(fp);
+		return err;
+	}
+
+	if (h.version != TRACE_VERSION || fstat(fd, &st)) {
+		fprintf(stderr, "Unsupported trace file version %u\n", h.version);
+		close(fd);
+		return -1;
+	}
+	tr->length = st.st_size;
+	tr->base = mmap(NULL, tr->length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (tr->base == MAP_FAILED) {
+		perror("Trace mmap");
+		return -1;
+	}
+	tr->num_threads = h.num_threads;
+	tr->num_channels = h.num_channels;
+	tr->threads = (struct trace_thread *)(tr->base + sizeof(h));
+	tr->channels = (struct trace_channel *)(tr->threads + h.num_threads);
+
+	// Check the tables before anything trusts them
+	if (sizeof(h) + (uint64_t)h.num_threads * sizeof(*tr->threads) +
+	    (uint64_t)h.num_channels * sizeof(*tr->channels) > tr->length) {
+		goto bad;
+	}
+	for (t = 0; t < tr->num_channels; t++) {
+		if (tr->channels[t].puts != tr->channels[t].gets) {
+			goto bad;
+		}
+	}
+	for (t = 0; t < tr->num_threads; t++) {
+		end = tr->threads[t].offset + tr->threads[t].num_ops * sizeof(struct trace_op);
+		if (tr->threads[t].offset % sizeof(struct trace_op) || end > tr->length ||
+		    end < tr->threads[t].offset) {
+			goto bad;
+		}
+	}
+
+	// and then every op, which the replay uses to index its tables without checking
+	if (tr->num_channels) {
+		puts = grow_table(NULL, &puts_bytes, tr->num_channels, sizeof(*puts));
+		if (!puts) {
+			trace_close(tr);
+			return -1;
+		}
+	}
+	for (t = 0; t < tr->num_threads; t++) {
+		op = trace_ops(tr, t);
+		for (i = 0; i < tr->threads[t].num_ops; i++, op++) {
+			end = (uint64_t)op->index + (op->type == MALLOC_BATCH || op->type == FREE_BATCH ? op->count : 1);
+			if (op->type >= OP_TYPES || end > tr->threads[t].num_locations) {
+				goto bad;
+			}
+			if (op->type != PUT && op->type != GET) {
+				continue;
+			}
+			if (op->channel >= tr->num_channels ||
+			    (op->type == PUT ? tr->channels[op->channel].sender : tr->channels[op->channel].receiver) != t + 1) {
+				goto bad;
+			}
+			if (op->type == PUT) {
+				puts[op->channel]++;
+			}
+		}
+	}
+	for (t = 0; t < tr->num_channels; t++) {
+		if (puts[t] != tr->channels[t].puts) {
+			goto bad;
+		}
+	}
+	if (puts_bytes) {
+		munmap(puts, puts_bytes);
+	}
+	return 0;
+
+bad:
+	fprintf(stderr, "Corrupt trace file %s\n", path);
+	if (puts_bytes) {
+		munmap(puts, puts_bytes);
+	}
+	trace_close(tr);
+	return -1;
+}
+
+void trace_close(struct trace *tr)
+{
+	munmap(tr->base, tr->length);
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdint.h>
+
+/* A binary trace is a header, a table with an entry per thread, a table with
+ * an entry per channel and then each thread's operations, stored
+ * contiguously so a replay thread can walk its own stream straight out of
+ * the mapped file. Everything is in host byte order. Text traces are
+ * converted into the same layout when they are loaded, trace2bin writes it
+ * to a file and gentrace generates it.
+ *
+ * Channels carry blocks from one thread to another: PUT moves the block in
+ * one of the sender's slots onto the channel and GET waits for the next one
+ * and moves it into a slot of the receiver, which can then free it. Every
+ * channel has a single sender and a single receiver, and every block put on
+ * it must be taken off.
+ */
+
+#define TRACE_MAGIC "MTRACE\r\n" // the \r\n catches files mangled by newline conversion
+#define TRACE_VERSION 2
+#define TRACE_ALIGN 4096 // every thread's stream starts on a page of its own
+#define TRACE_MAX_THREADS 4096 // test_malloc starts a thread for each, so a thread number past this is a corrupt trace
+#define TRACE_MAX_CHANNELS (1 << 24) // at most one per pair of threads
+
+enum trace_type {MALLOC, FREE, MALLOC_BATCH, FREE_BATCH, MEMALIGN, REALLOC, CALLOC, FREE_SIZED,
+                 PUT, GET};
+
+#define OP_TYPES (GET + 1)
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_threads;
+	uint32_t num_channels;
+	uint32_t unused;
+};
+
+struct trace_thread {
+	uint64_t offset; // of the thread's first operation, from the start of the file
+	uint64_t num_ops;
+	uint64_t num_locations; // one past the highest block slot the ops use
+};
+
+struct trace_channel {
+	uint64_t puts;
+	uint64_t gets;
+	uint32_t sender;   // threads at the two ends, plus one so that 0 is neither
+	uint32_t receiver;
+};
+
+struct trace_op {
+	uint8_t type; // an enum trace_type
+	uint8_t unused[3];
+	uint32_t index; // for myfree() to use later
+	uint32_t size;
+	union {
+		uint32_t count; // blocks index to index + count - 1 for the batch ops, elements for calloc
+		uint32_t align; // alignment asked of mymemalign()
+		uint32_t channel; // for PUT and GET
+	};
+};
+
+// A trace mapped into memory
+struct trace {
+	char *base;
+	size_t length;
+	uint32_t num_threads;
+	uint32_t num_channels;
+	struct trace_thread *threads;
+	struct trace_channel *channels;
+};
+
+// What a trace holds, gathered op by op before it is laid out
+struct trace_tally {
+	struct trace_thread *threads;
+	struct trace_channel *channels;
+	size_t threads_bytes;
+	size_t channels_bytes;
+	uint32_t num_threads;
+	uint32_t num_channels;
+};
+
+/* A recording is what librecord.so writes while a program runs: a header,
+ * then every thread's calls in the order its buffers were written out.
+ * trace2bin -r sorts them by time, gives each block a slot and turns frees
+ * of blocks allocated by another thread into a PUT and a GET.
+ */
+#define RECORD_MAGIC "MRECORD\n"
+#define RECORD_VERSION 1
+
+enum record_type {REC_MALLOC, REC_FREE, REC_CALLOC, REC_REALLOC, REC_MEMALIGN};
+
+struct record_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t unused;
+};
+
+struct record {
+	uint64_t time; // cycle counter, read before a free and after everything else returned
+	uint64_t ptr; // block returned, or the one freed
+	uint64_t old; // block realloc was given, elements for calloc, alignment for memalign
+	uint64_t size;
+	uint32_t thread; // kernel thread id
+	uint32_t type; // an enum record_type
+};
+
+int trace_open(const char *path, struct trace *tr); // Returns 0 on success and -1 on error.
+int trace_convert(FILE *fp, int fd, struct trace *tr); // Returns 0 on success and -1 on error.
+int trace_read_op(FILE *fp, uint32_t *thread, struct trace_op *op); // Returns 1 per op, 0 at the end and -1 on error.
+void trace_write_op(FILE *fp, uint32_t thread, struct trace_op *op);
+int trace_tally_op(struct trace_tally *t, uint32_t thread, struct trace_op *op); // Returns 0 on success and -1 on error.
+int trace_layout(struct trace_tally *t, int fd, struct trace *tr); // Returns 0 on success and -1 on error.
+void trace_put_op(struct trace_tally *t, struct trace *tr, uint32_t thread, struct trace_op *op);
+void trace_tally_free(struct trace_tally *t);
+void trace_close(struct trace *tr);
+
+static inline struct trace_op *trace_ops(struct trace *tr, uint32_t thread)
+{
+	return (struct trace_op *)(tr->base + tr->threads[thread].offset);
+}
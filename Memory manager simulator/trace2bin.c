@@ -0,0 +1,473 @@
+/* Converts text traces to the binary format test_malloc maps, and back,
+ * and turns recordings made with librecord.so into binary traces.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+void usage(char *argv[])
+{
+	printf("Usage: %s <text trace> <binary trace>\n", argv[0]);
+	printf("       %s -d <binary trace>\n", argv[0]);
+	printf("       %s -r <recording> <binary trace>\n", argv[0]);
+	printf("\t-d : print a binary trace as text, one thread after another\n");
+	printf("\t-r : convert a recording made with librecord.so\n");
+	exit(1);
+}
+
+/* A hash table from 64 bit keys to 64 bit values, with linear probing and
+ * deletion by shifting the entries after a hole back into it. It maps block
+ * addresses to their thread and slot, kernel thread ids to trace threads and
+ * thread pairs to the channel between them.
+ */
+#define EMPTY (~0ULL)
+
+struct table {
+	uint64_t *keys;
+	uint64_t *values;
+	uint64_t mask;
+	uint64_t count;
+};
+
+uint64_t hash(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	return key ^ (key >> 33);
+}
+
+void table_init(struct table *t, uint64_t size)
+{
+	t->keys = malloc(size * sizeof(uint64_t));
+	t->values = malloc(size * sizeof(uint64_t));
+	if (!t->keys || !t->values) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memset(t->keys, 0xff, size * sizeof(uint64_t));
+	t->mask = size - 1;
+	t->count = 0;
+}
+
+// Where key is, or the empty entry it would go in
+uint64_t table_find(struct table *t, uint64_t key)
+{
+	uint64_t i = hash(key) & t->mask;
+	while (t->keys[i] != key && t->keys[i] != EMPTY) {
+		i = (i + 1) & t->mask;
+	}
+	return i;
+}
+
+void table_put(struct table *t, uint64_t key, uint64_t value)
+{
+	struct table old;
+	uint64_t i = table_find(t, key);
+	if (t->keys[i] == EMPTY) {
+		if (2 * (t->count + 1) > t->mask + 1) {
+			old = *t;
+			table_init(t, 2 * (old.mask + 1));
+			for (i = 0; i <= old.mask; i++) {
+				if (old.keys[i] != EMPTY) {
+					table_put(t, old.keys[i], old.values[i]);
+				}
+			}
+			free(old.keys);
+			free(old.values);
+			i = table_find(t, key);
+		}
+		t->count++;
+	}
+	t->keys[i] = key;
+	t->values[i] = value;
+}
+
+void table_delete(struct table *t, uint64_t i)
+{
+	uint64_t j = i, home;
+	t->count--;
+	for (;;) {
+		t->keys[i] = EMPTY;
+		do {
+			j = (j + 1) & t->mask;
+			if (t->keys[j] == EMPTY) {
+				return;
+			}
+			home = hash(t->keys[j]) & t->mask;
+			// an entry can fill the hole unless its home lies between the hole and it
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+		t->keys[i] = t->keys[j];
+		t->values[i] = t->values[j];
+		i = j;
+	}
+}
+
+void table_free(struct table *t)
+{
+	free(t->keys);
+	free(t->values);
+}
+
+// What converting a recording keeps track of
+struct replay_thread {
+	uint32_t *free_slots; // reused last freed first
+	uint32_t num_free;
+	uint32_t next_slot;
+	uint32_t cap;
+};
+
+struct convert {
+	struct table blocks; // address to thread << 32 | slot
+	struct table threads; // kernel thread id to trace thread
+	struct table channels; // sender << 32 | receiver to channel
+	struct replay_thread *replay;
+	uint32_t num_threads;
+	struct trace_tally *tally;
+	struct trace *tr; // NULL while the ops are only counted
+	uint64_t unknown; // frees and reallocs of blocks allocated before recording began
+	uint64_t passed; // blocks freed by a thread other than the one that allocated them
+};
+
+void emit(struct convert *c, uint32_t thread, struct trace_op *op)
+{
+	if (c->tr) {
+		trace_put_op(c->tally, c->tr, thread, op);
+	} else if (trace_tally_op(c->tally, thread, op)) {
+		exit(1);
+	}
+}
+
+uint32_t take_slot(struct convert *c, uint32_t thread)
+{
+	struct replay_thread *r = &c->replay[thread];
+	if (r->num_free) {
+		return r->free_slots[--r->num_free];
+	}
+	if (r->next_slot == r->cap) {
+		r->cap = r->cap ? 2 * r->cap : 1024;
+		r->free_slots = realloc(r->free_slots, r->cap * sizeof(uint32_t));
+		if (!r->free_slots) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	return r->next_slot++;
+}
+
+void give_slot(struct convert *c, uint32_t thread, uint32_t slot)
+{
+	struct replay_thread *r = &c->replay[thread];
+	r->free_slots[r->num_free++] = slot;
+}
+
+uint32_t trace_thread(struct convert *c, uint32_t tid)
+{
+	uint64_t i = table_find(&c->threads, tid);
+	if (c->threads.keys[i] != EMPTY) {
+		return c->threads.values[i];
+	}
+	c->replay = realloc(c->replay, (c->num_threads + 1) * sizeof(*c->replay));
+	if (!c->replay) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memset(&c->replay[c->num_threads], 0, sizeof(*c->replay));
+	table_put(&c->threads, tid, c->num_threads);
+	return c->num_threads++;
+}
+
+/* Give thread the block at table entry i, which another thread may have
+ * allocated; returns the block's slot in thread. The owner puts it on the
+ * channel between the two at this point in its stream and the receiver gets
+ * it, and since both ops sit at the same time in their streams and a put
+ * never waits, no replay thread can end up waiting on one waiting for it.
+ */
+uint32_t bring_home(struct convert *c, uint64_t i, uint32_t thread)
+{
+	uint32_t owner = c->blocks.values[i] >> 32, slot = (uint32_t)c->blocks.values[i];
+	struct trace_op op = {0};
+	uint64_t pair = (uint64_t)owner << 32 | thread, j;
+
+	if (owner == thread) {
+		return slot;
+	}
+	j = table_find(&c->channels, pair);
+	if (c->channels.keys[j] == EMPTY) {
+		table_put(&c->channels, pair, c->channels.count);
+		j = table_find(&c->channels, pair);
+	}
+	op.type = PUT;
+	op.index = slot;
+	op.channel = c->channels.values[j];
+	emit(c, owner, &op);
+	give_slot(c, owner, slot);
+
+	op.type = GET;
+	op.index = slot = take_slot(c, thread);
+	emit(c, thread, &op);
+	c->blocks.values[i] = (uint64_t)thread << 32 | slot;
+	c->passed++;
+	return slot;
+}
+
+void free_entry(struct convert *c, uint64_t i, uint32_t thread)
+{
+	struct trace_op op = {0};
+	op.type = FREE;
+	op.index = bring_home(c, i, thread);
+	emit(c, thread, &op);
+	give_slot(c, thread, op.index);
+	table_delete(&c->blocks, i);
+}
+
+// A new block at ptr for thread, returns its slot
+uint32_t new_block(struct convert *c, uint64_t ptr, uint32_t thread)
+{
+	uint64_t i = table_find(&c->blocks, ptr);
+	uint32_t slot;
+	if (c->blocks.keys[i] != EMPTY) {
+		// its free was recorded after this on another thread, it must have come first
+		free_entry(c, i, c->blocks.values[i] >> 32);
+	}
+	slot = take_slot(c, thread);
+	table_put(&c->blocks, ptr, (uint64_t)thread << 32 | slot);
+	return slot;
+}
+
+/* Turn the recording, sorted by time, into ops, which emit() either counts
+ * or writes. Blocks too big for a trace are left out, and so are frees of
+ * blocks the recording never saw allocated.
+ */
+void convert_records(struct convert *c, struct record *recs, uint64_t n)
+{
+	struct trace_op op;
+	uint64_t k, i;
+	uint32_t thread;
+
+	table_init(&c->blocks, 1024);
+	table_init(&c->threads, 64);
+	table_init(&c->channels, 64);
+	c->replay = NULL;
+	c->num_threads = 0;
+	c->unknown = c->passed = 0;
+
+	for (k = 0; k < n; k++) {
+		struct record *r = &recs[k];
+		thread = trace_thread(c, r->thread);
+		memset(&op, 0, sizeof(op));
+		if (r->size > UINT32_MAX || r->old > UINT32_MAX) {
+			if (r->type != REC_REALLOC && r->type != REC_FREE) {
+				continue;
+			}
+		}
+
+		switch (r->type) {
+		case REC_MALLOC:
+		case REC_CALLOC:
+		case REC_MEMALIGN:
+			op.type = r->type == REC_MALLOC ? MALLOC : r->type == REC_CALLOC ? CALLOC : MEMALIGN;
+			op.size = r->size;
+			op.count = r->old; // the element count for calloc, the alignment for memalign
+			op.index = new_block(c, r->ptr, thread);
+			emit(c, thread, &op);
+			break;
+
+		case REC_FREE:
+			i = table_find(&c->blocks, r->ptr);
+			if (c->blocks.keys[i] == EMPTY) {
+				c->unknown++;
+				break;
+			}
+			free_entry(c, i, thread);
+			break;
+
+		case REC_REALLOC:
+			i = r->old ? table_find(&c->blocks, r->old) : 0;
+			if (r->old && c->blocks.keys[i] == EMPTY) {
+				c->unknown++;
+			}
+			if (r->ptr == 0) {
+				// realloc(p, 0) freed p, anything else that returns NULL failed
+				if (r->size == 0 && r->old && c->blocks.keys[i] != EMPTY) {
+					free_entry(c, i, thread);
+				}
+				break;
+			}
+			if (r->size > UINT32_MAX) {
+				break;
+			}
+			op.size = r->size;
+			if (!r->old || c->blocks.keys[i] == EMPTY) {
+				op.type = MALLOC;
+				op.index = new_block(c, r->ptr, thread);
+				emit(c, thread, &op);
+				break;
+			}
+			op.type = REALLOC;
+			op.index = bring_home(c, i, thread);
+			emit(c, thread, &op);
+			if (r->ptr != r->old) {
+				table_delete(&c->blocks, i);
+				i = table_find(&c->blocks, r->ptr);
+				if (c->blocks.keys[i] != EMPTY) {
+					free_entry(c, i, c->blocks.values[i] >> 32);
+				}
+				table_put(&c->blocks, r->ptr, (uint64_t)thread << 32 | op.index);
+			}
+			break;
+		}
+	}
+
+	table_free(&c->blocks);
+	table_free(&c->threads);
+	table_free(&c->channels);
+	for (k = 0; k < c->num_threads; k++) {
+		free(c->replay[k].free_slots);
+	}
+	free(c->replay);
+}
+
+int by_time(const void *a, const void *b)
+{
+	const struct record *x = a, *y = b;
+	if (x->time != y->time) {
+		return x->time < y->time ? -1 : 1;
+	}
+	return x->thread < y->thread ? -1 : x->thread > y->thread;
+}
+
+/* Convert the recording at path into a binary trace written to fd. The
+ * cycle counters of all the CPUs are taken to agree, as they do on any
+ * machine with an invariant TSC, so sorting by time puts every free after
+ * the allocation it frees.
+ */
+int convert_recording(const char *path, int fd)
+{
+	struct trace_tally tally = {0};
+	struct convert c = {0};
+	struct trace tr;
+	struct record_header *h;
+	struct record *recs;
+	struct stat st;
+	uint64_t n;
+	char *base;
+	int in;
+
+	if ((in = open(path, O_RDONLY)) < 0 || fstat(in, &st)) {
+		perror("Recording open");
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(*h)) {
+		fprintf(stderr, "Not a recording: %s\n", path);
+		close(in);
+		return -1;
+	}
+	// private and writable, so it can be sorted in place without touching the file
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, in, 0);
+	close(in);
+	if (base == MAP_FAILED) {
+		perror("Recording mmap");
+		return -1;
+	}
+	h = (struct record_header *)base;
+	if (memcmp(h->magic, RECORD_MAGIC, sizeof(h->magic)) != 0 || h->version != RECORD_VERSION) {
+		fprintf(stderr, "Not a recording: %s\n", path);
+		munmap(base, st.st_size);
+		return -1;
+	}
+	recs = (struct record *)(h + 1);
+	n = (st.st_size - sizeof(*h)) / sizeof(struct record); // a record cut off by a crash is dropped
+	qsort(recs, n, sizeof(struct record), by_time);
+
+	// The same conversion twice, to count the ops and then to write them
+	c.tally = &tally;
+	c.tr = NULL;
+	convert_records(&c, recs, n);
+	if (trace_layout(&tally, fd, &tr)) {
+		trace_tally_free(&tally);
+		munmap(base, st.st_size);
+		return -1;
+	}
+	c.tr = &tr;
+	convert_records(&c, recs, n);
+	printf("%lu records, %u threads, %lu blocks freed by another thread, %lu unknown blocks\n",
+	       (unsigned long)n, c.num_threads, (unsigned long)c.passed, (unsigned long)c.unknown);
+
+	trace_tally_free(&tally);
+	munmap(base, st.st_size);
+	if (msync(tr.base, tr.length, MS_SYNC)) {
+		perror("Binary trace write");
+		trace_close(&tr);
+		return -1;
+	}
+	trace_close(&tr);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace tr;
+	uint32_t t;
+	uint64_t i;
+	FILE *fp;
+	int fd, err;
+
+	if (argc == 4 && strcmp(argv[1], "-r") == 0) {
+		if ((fd = open(argv[3], O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+			perror("Binary trace open");
+			return 1;
+		}
+		err = convert_recording(argv[2], fd);
+		if (close(fd) || err) {
+			unlink(argv[3]);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (argc != 3) {
+		usage(argv);
+	}
+
+	if (strcmp(argv[1], "-d") == 0) {
+		if (trace_open(argv[2], &tr)) {
+			return 1;
+		}
+		for (t = 0; t < tr.num_threads; t++) {
+			for (i = 0; i < tr.threads[t].num_ops; i++) {
+				trace_write_op(stdout, t, &trace_ops(&tr, t)[i]);
+			}
+		}
+		trace_close(&tr);
+		return 0;
+	}
+
+	if ((fp = fopen(argv[1], "r")) == NULL) {
+		perror("Trace file open");
+		return 1;
+	}
+	if ((fd = open(argv[2], O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("Binary trace open");
+		return 1;
+	}
+	err = trace_convert(fp, fd, &tr);
+	fclose(fp);
+	if (err) {
+		close(fd);
+		unlink(argv[2]);
+		return 1;
+	}
+	err = msync(tr.base, tr.length, MS_SYNC);
+	trace_close(&tr);
+	if (err || close(fd)) {
+		perror("Binary trace write");
+		return 1;
+	}
+	return 0;
+}